@@ -8,80 +8,308 @@
 #include <linux/mm.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/ratelimit.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/sort.h>
+#include <linux/sched/clock.h>
+#include <linux/hardirq.h>
+#include <linux/err.h>
+#include <linux/file.h>
+#include <linux/uio.h>
+#include <linux/sched/signal.h>
+#include <linux/crc32.h>
+
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#include <linux/lz4.h>
+#define HAVE_LZ4 1
+#endif
+
+#include "crashstash.h"
 
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("A proc file which you can write into and retrieve from the core dump.");
 MODULE_AUTHOR("Stephen Brennan <stephen@brennan.io>");
 
 
-DEFINE_MUTEX(crashstash_lock);
-int count;
-struct proc_dir_entry *pde;
+/* default limit of 10 MiB per stash, writes will stop working after that */
+#define DEFAULT_CAPACITY (10 * 1024 * 1024)
+
+/*
+ * Stash memory is allocated in chunks of up to 2^CRASHSTASH_CHUNK_ORDER pages,
+ * falling back to smaller chunks when memory is fragmented.
+ */
+#define CRASHSTASH_CHUNK_ORDER 9
+
+/*
+ * In ring mode, each write() appends one record: a u32 length followed by the
+ * data, padded to a multiple of 4 bytes. Once the stash is full, the oldest
+ * records are overwritten. The head and tail are "logical" offsets which only
+ * increase, the position in the stash pages is the offset modulo capacity.
+ *
+ * crashstash.py reads this structure from the vmcore as a sequence of u64, at
+ * the META address printed in the log. Only append fields to the end. The
+ * CRASHSTASH_F_* flags are defined in crashstash.h.
+ */
+struct crashstash_meta {
+	u64 flags;
+	u64 head;      /* logical offset of the next record */
+	u64 tail;      /* logical offset of the oldest record */
+	u64 capacity;  /* size of the ring in bytes */
+	u64 nr_cpus;   /* percpu: number of per-CPU buffers */
+	u64 cpu_size;  /* percpu: size of each per-CPU buffer in bytes */
+	u64 stage;     /* lz4: address of the data not yet compressed */
+	u64 stage_len; /* lz4: length of the data not yet compressed */
+};
+
+/*
+ * In lz4 mode, written data is collected in a staging buffer, and each time it
+ * fills up, it is compressed and appended to the stash as a chunk: this header,
+ * followed by the compressed data. The staging buffer is ordinary kernel
+ * memory, so its contents are in the vmcore too. Reading returns the
+ * decompressed data.
+ */
+#define CRASHSTASH_LZ4_CHUNK (64 * 1024)
+struct crashstash_lz4_hdr {
+	u32 clen;  /* compressed length */
+	u32 ulen;  /* uncompressed length */
+};
+
+/*
+ * In percpu mode, the pages are preallocated and split evenly between the
+ * possible CPUs. A writer reserves space for its record in the current CPU's
+ * buffer with one atomic add, and fills it in without taking any lock. The
+ * commit field is written last, so readers (including crashstash.py) stop at a
+ * record which is still being written. Records are 8-byte aligned, so a header
+ * never straddles two pages.
+ *
+ * Reading a percpu stash returns the committed records from all CPUs, sorted by
+ * timestamp, each with a struct crashstash_rec_out header.
+ */
+struct crashstash_rec {
+	u64 ts;      /* local_clock() at reservation */
+	u32 len;     /* length of data, excluding this header and padding */
+	u32 commit;  /* CRASHSTASH_REC_* */
+};
+#define CRASHSTASH_REC_VALID   1
+#define CRASHSTASH_REC_INVALID 2  /* copy failed, skip the data */
+
+struct crashstash_rec_out {
+	u64 ts;
+	u32 len;
+	u32 cpu;
+};
+
+/*
+ * Each stash is a file /proc/crashstash/NAME, with its own lock, opener count,
+ * size limit and list of pages.
+ */
+struct crashstash {
+	struct list_head node;  /* on crashstash_list */
+	char name[CRASHSTASH_NAME_MAX];
+	struct proc_dir_entry *pde;
+
+	struct mutex lock;
+	int count;
+	struct ratelimit_state ratelimit;
+
+	struct crashstash_desc *desc;  /* on a page of its own */
+
+	struct list_head list;  /* first page of each chunk, linked by page->lru */
+	u64 size;
+	u64 pages;              /* total pages in all chunks */
+	u64 maxsize;
+	bool mapped;
+
+	/*
+	 * The list above is what vmcore analysis walks, but walking it to
+	 * find the page for a given offset makes reading the whole stash
+	 * quadratic. This array indexes the same pages by their position, so
+	 * reads can seek in O(1).
+	 */
+	struct page **page_index;
+
+	/* percpu mode: bytes reserved in each CPU's buffer */
+	atomic64_t __percpu *reserved;
+	/*
+	 * percpu and lz4 mode: the (single) reader's view of the stash, i.e.
+	 * merged records or decompressed data
+	 */
+	void *snap;
+	size_t snap_size;
+
+	/* lz4 mode: staging buffer, and scratch space for (de)compression */
+	void *stage;
+	void *lz4_buf;
+	void *lz4_wrkmem;
+
+	struct crashstash_meta meta;
+};
+
+DEFINE_MUTEX(crashstash_list_lock);
+LIST_HEAD(crashstash_list);
+struct proc_dir_entry *crashstash_dir;
+struct crashstash_root crashstash_descriptor;
+
+static bool ring;
+module_param(ring, bool, 0444);
+MODULE_PARM_DESC(ring, "Create the default stash in ring mode: overwrite the oldest records when full");
+
+static bool prealloc;
+module_param(prealloc, bool, 0444);
+MODULE_PARM_DESC(prealloc, "Allocate the full capacity of every stash when it is created, so writes never allocate");
+
+static ulong capacity = DEFAULT_CAPACITY;
+module_param(capacity, ulong, 0444);
+MODULE_PARM_DESC(capacity, "Maximum size of each stash in bytes, and the default size");
 
-LIST_HEAD(crashstash);
-u64 size;
-u64 pages;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,17,0)
+#define pde_data(inode) PDE_DATA(inode)
+#endif
 
-/* arbitrary limit of 10 MiB, writes will stop working after that */
-#define MAXSIZE (10 * 1024 * 1024)
+/*
+ * The size of the file reported by stat(). For a preallocated stash, this is its
+ * capacity, since that memory is committed regardless of how much is written.
+ */
+static void crashstash_update_size(struct crashstash *cs)
+{
+	if (cs->meta.flags & CRASHSTASH_F_PREALLOC)
+		proc_set_size(cs->pde, cs->meta.capacity);
+	else
+		proc_set_size(cs->pde, cs->size);
+}
 
-static void crashstash_free(void)
+static void crashstash_free(struct crashstash *cs)
 {
 	struct page *cur, *next;
+	unsigned long i, order;
 
-	BUG_ON(!mutex_is_locked(&crashstash_lock));
-	list_for_each_entry_safe(cur, next, &crashstash, lru)
+	BUG_ON(!mutex_is_locked(&cs->lock));
+	list_for_each_entry_safe(cur, next, &cs->list, lru)
 	{
 		list_del(&cur->lru);
-		__free_page(cur);
+		order = page_private(cur);
+		set_page_private(cur, 0);
+		for (i = 0; i < (1UL << order); i++)
+			__free_page(nth_page(cur, i));
 	}
-	size = 0;
-	pages = 0;
+	memset(cs->page_index, 0, cs->meta.capacity / PAGE_SIZE * sizeof(struct page *));
+	cs->size = 0;
+	cs->pages = 0;
+	cs->mapped = false;
+	cs->meta.head = 0;
+	cs->meta.tail = 0;
+	cs->meta.stage_len = 0;
+}
+
+/*
+ * Empty the stash. Normally this frees its pages, but a preallocated stash
+ * keeps them, so that writes never need to allocate memory.
+ */
+static void crashstash_clear(struct crashstash *cs)
+{
+	if (!(cs->meta.flags & CRASHSTASH_F_PREALLOC)) {
+		crashstash_free(cs);
+		return;
+	}
+	cs->size = 0;
+	cs->mapped = false;
+	cs->meta.head = 0;
+	cs->meta.tail = 0;
+	cs->meta.stage_len = 0;
+}
+
+/*
+ * Put the name of the stash, and the address of its page list head, size, pages
+ * and metadata, in the kernel log. This is necessary in order for later vmcore
+ * analysis to be able to find and interpret the crashstash.
+ *
+ * Writing to the log at open-time is best, because release() is not reliably
+ * called directly after the file is closed. These memory addresses don't change
+ * at runtime, but we want them to be in the log buffer when a vmcore is
+ * generated, so writing the message just at initialization time isn't good
+ * enough: it may be a long time between initialization and when a vmcore is
+ * generated.
+ *
+ * Of course, if the file is written to a lot, we could cause log spam, so
+ * ratelimit it. Each stash has its own ratelimit, so a busy stash can't
+ * suppress the messages for the others.
+ */
+static void crashstash_log(struct crashstash *cs)
+{
+	if (__ratelimit(&cs->ratelimit))
+		pr_info("crashstash: NAME: %s STASH: %llx SIZE: %llx PAGES: %llx META: %llx DESC: %llx\n",
+			cs->name, (u64)&cs->list, (u64)&cs->size,
+			(u64)&cs->pages, (u64)&cs->meta, (u64)cs->desc);
+}
+
+static int crashstash_percpu_snapshot(struct crashstash *cs);
+static int crashstash_lz4_snapshot(struct crashstash *cs);
+
+/*
+ * Percpu stashes may have any number of writers at once, and one reader, who
+ * gets a snapshot of the records at open time. They are never cleared.
+ */
+static int crashstash_percpu_open(struct crashstash *cs, int mode)
+{
+	int rv;
+
+	if (mode == O_RDWR)
+		return -EINVAL;
+	if (mode == O_RDONLY) {
+		if (cs->snap)
+			return -EBUSY;
+		rv = crashstash_percpu_snapshot(cs);
+		if (rv)
+			return rv;
+	} else {
+		crashstash_log(cs);
+	}
+	cs->count++;
+	return 0;
 }
 
 static int crashstash_open(struct inode *inode, struct file *filp)
 {
 	int rv = 0;
 	int mode = filp->f_flags & O_ACCMODE;
+	struct crashstash *cs = pde_data(inode);
 	nonseekable_open(inode, filp);
-	mutex_lock(&crashstash_lock);
-	if (count) {
-		rv = -EBUSY;
+	filp->private_data = cs;
+	mutex_lock(&cs->lock);
+	if (cs->meta.flags & CRASHSTASH_F_PERCPU) {
+		rv = crashstash_percpu_open(cs, mode);
 		goto out;
 	}
-	/* We won't support read/write mode: either read or write */
-	if (mode == O_RDWR) {
-		rv = -EINVAL;
+	if (cs->count) {
+		rv = -EBUSY;
 		goto out;
 	}
-
-	/* Writers automatically clear the old contents and setup a new stash */
-	if (mode == O_WRONLY) {
-		crashstash_free();
+	/*
+	 * Writers automatically clear the old contents and setup a new stash.
+	 * We don't support mixing read() and write(), but O_RDWR is required
+	 * for a shared writable mmap(), so it is treated as a writer.
+	 */
+	if (mode == O_WRONLY || mode == O_RDWR) {
 		/*
-		 * Put the address of the crashstash list head, and the size and
-		 * pages variables, in the kernel log. This is necessary in
-		 * order for later vmcore analysis to be able to find and
-		 * interpret the crashstash.
-		 *
-		 * Writing to the log at open-time is best, because release() is
-		 * not reliably called directly after the file is closed. These
-		 * memory addresses don't change at runtime, but we want them to
-		 * be in the log buffer when a vmcore is generated, so writing
-		 * the message just at initialization time isn't good enough: it
-		 * may be a long time between initialization and when a vmcore
-		 * is generated.
-		 *
-		 * Of course, if the file is written to a lot, we could cause
-		 * log spam, so use pr_info_ratelimited().
+		 * ... except in ring mode, which keeps accumulating records
+		 * across opens, so that a restarted writer just continues.
 		 */
-		pr_info_ratelimited("crashstash: STASH: %llx SIZE: %llx PAGES: %llx\n",
-				    (u64)&crashstash, (u64)&size, (u64)&pages);
+		if (!(cs->meta.flags & CRASHSTASH_F_RING))
+			crashstash_clear(cs);
+		crashstash_log(cs);
+	} else if (cs->meta.flags & CRASHSTASH_F_LZ4) {
+		rv = crashstash_lz4_snapshot(cs);
+		if (rv)
+			goto out;
 	}
-	count++;
+	cs->count++;
 
 out:
-	mutex_unlock(&crashstash_lock);
+	mutex_unlock(&cs->lock);
 	return rv;
 }
 
@@ -89,48 +317,512 @@ static int crashstash_release(struct inode *inode, struct file *filp)
 {
 	/* release() is called... at some point after the last close()
 	 * but before any subsequent open(). Be sure to drop our reference
-	 * to the file so it can be reopened. */
-	mutex_lock(&crashstash_lock);
-	BUG_ON(count <= 0);
-	count--;
-	mutex_unlock(&crashstash_lock);
+	 * to the file so it can be reopened. A mapping holds a reference to
+	 * the file, so this also won't happen until it's unmapped. */
+	struct crashstash *cs = filp->private_data;
+
+	mutex_lock(&cs->lock);
+	BUG_ON(cs->count <= 0);
+	cs->count--;
+	if ((cs->meta.flags & (CRASHSTASH_F_PERCPU | CRASHSTASH_F_LZ4)) &&
+	    (filp->f_mode & FMODE_READ)) {
+		kvfree(cs->snap);
+		cs->snap = NULL;
+		cs->snap_size = 0;
+	}
+	mutex_unlock(&cs->lock);
 	return 0;
 }
 
+/*
+ * Add a chunk of at most "max_pages" pages to the end of the stash. Chunks are
+ * split into ordinary pages, so that they can be mapped and freed individually,
+ * but only the first page of each chunk is on the stash's list, with the order
+ * of the chunk in its page_private(). So the list is short, and vmcore analysis
+ * can read each chunk with one contiguous read. The page index has every page.
+ */
+static int crashstash_alloc_chunk(struct crashstash *cs, u64 max_pages, gfp_t gfp)
+{
+	unsigned int order = min_t(unsigned int, CRASHSTASH_CHUNK_ORDER, ilog2(max_pages));
+	struct page *pg;
+	unsigned long i;
+
+	BUG_ON(!max_pages);
+	for (;;) {
+		/* Don't try hard for large chunks, we can always use smaller ones */
+		pg = alloc_pages(order ? gfp | __GFP_NORETRY | __GFP_NOWARN : gfp, order);
+		if (pg || !order)
+			break;
+		order--;
+	}
+	if (!pg)
+		return -ENOMEM;
+	if (order)
+		split_page(pg, order);
+	set_page_private(pg, order);
+	list_add_tail(&pg->lru, &cs->list);
+	for (i = 0; i < (1UL << order); i++)
+		cs->page_index[cs->pages++] = nth_page(pg, i);
+	return 0;
+}
+
+/*
+ * Return the page at byte offset "pos" of the stash, allocating it if this is
+ * the first time the stash has grown that far. Since stashes are always
+ * written sequentially, a new page is always the next one. (Percpu and
+ * preallocated stashes have every page allocated up front, so we never
+ * allocate for them here.)
+ */
+static struct page *crashstash_page(struct crashstash *cs, u64 pos)
+{
+	u64 pgnum = pos / PAGE_SIZE;
+
+	if (pgnum < cs->pages)
+		return cs->page_index[pgnum];
+	BUG_ON(pgnum != cs->pages);
+	if (crashstash_alloc_chunk(cs, cs->meta.capacity / PAGE_SIZE - cs->pages, GFP_KERNEL))
+		return NULL;
+	return cs->page_index[pgnum];
+}
+
+/*
+ * Copy "len" bytes into the stash at offset "pos" (which, for the ring, is a
+ * logical offset), from kernel or user memory.
+ */
+static int crashstash_store(struct crashstash *cs, u64 pos, const void *kdata,
+				 const char __user *udata, size_t len)
+{
+	size_t pgoff, chunk_amt;
+	struct page *pg;
+	void *dst;
+
+	while (len) {
+		pos %= cs->meta.capacity;
+		pg = crashstash_page(cs, pos);
+		if (!pg)
+			return -ENOMEM;
+		pgoff = pos % PAGE_SIZE;
+		chunk_amt = min(len, PAGE_SIZE - pgoff);
+		dst = (void *)page_address(pg) + pgoff;
+		if (kdata) {
+			memcpy(dst, kdata, chunk_amt);
+			kdata += chunk_amt;
+		} else {
+			if (copy_from_user(dst, udata, chunk_amt) != 0)
+				return -EFAULT;
+			udata += chunk_amt;
+		}
+		pos += chunk_amt;
+		len -= chunk_amt;
+	}
+	return 0;
+}
+
+static ssize_t crashstash_ring_write(struct crashstash *cs, const char __user *data, size_t amt)
+{
+	struct crashstash_meta *meta = &cs->meta;
+	u32 hdr = amt;
+	u64 total = sizeof(hdr) + ALIGN(amt, sizeof(hdr));
+	u64 pos;
+	int rv;
+
+	BUG_ON(!mutex_is_locked(&cs->lock));
+	if (total > meta->capacity)
+		return -EFBIG;
+
+	/*
+	 * Drop the oldest records until this one fits. Records are 4-byte
+	 * aligned, so a header never straddles two pages.
+	 */
+	while (meta->head + total - meta->tail > meta->capacity) {
+		pos = meta->tail % meta->capacity;
+		hdr = *(u32 *)(page_address(cs->page_index[pos / PAGE_SIZE]) + pos % PAGE_SIZE);
+		meta->tail += sizeof(hdr) + ALIGN(hdr, sizeof(hdr));
+	}
+
+	/* On failure, the head doesn't move, so the partial record is ignored */
+	hdr = amt;
+	rv = crashstash_store(cs, meta->head, &hdr, NULL, sizeof(hdr));
+	if (!rv)
+		rv = crashstash_store(cs, meta->head + sizeof(hdr), NULL, data, amt);
+	if (rv)
+		return rv;
+	meta->head += total;
+	cs->size = meta->head - meta->tail;
+	crashstash_update_size(cs);
+	return amt;
+}
+
+/* Return a pointer to "pos" in the stash, for an object which doesn't span pages */
+static void *crashstash_ptr(struct crashstash *cs, u64 pos)
+{
+	return page_address(cs->page_index[pos / PAGE_SIZE]) + pos % PAGE_SIZE;
+}
+
+static void crashstash_load(struct crashstash *cs, u64 pos, void *dst, size_t len)
+{
+	size_t chunk_amt;
+
+	while (len) {
+		chunk_amt = min(len, PAGE_SIZE - pos % PAGE_SIZE);
+		memcpy(dst, crashstash_ptr(cs, pos), chunk_amt);
+		dst += chunk_amt;
+		pos += chunk_amt;
+		len -= chunk_amt;
+	}
+}
+
+/*
+ * Reserve space for a record of "amt" bytes in the current CPU's buffer, and
+ * fill in its header. The caller copies the data in and then sets the commit
+ * field. Lockless: may be called by any number of writers concurrently, and
+ * from any context (with the caveat in crashstash_append()).
+ */
+static struct crashstash_rec *crashstash_percpu_reserve(struct crashstash *cs, size_t amt, u64 *pos)
+{
+	struct crashstash_rec *rec;
+	u64 total = sizeof(*rec) + ALIGN(amt, 8);
+	u64 cpu_size = cs->meta.cpu_size;
+	atomic64_t *reserved;
+	u64 off;
+	int cpu;
+
+	if (total > cpu_size)
+		return ERR_PTR(-EFBIG);
+	/*
+	 * If we migrate after choosing a CPU, we just share its buffer with
+	 * whoever is running there now, which is fine since it's atomic.
+	 */
+	cpu = raw_smp_processor_id();
+	reserved = per_cpu_ptr(cs->reserved, cpu);
+	off = atomic64_add_return(total, reserved) - total;
+	if (off + total > cpu_size)
+		return ERR_PTR(-ENOSPC);
+
+	*pos = cpu * cpu_size + off;
+	rec = crashstash_ptr(cs, *pos);
+	rec->ts = local_clock();
+	rec->len = amt;
+	*pos += sizeof(*rec);
+	return rec;
+}
+
+static ssize_t crashstash_percpu_write(struct crashstash *cs, const char __user *data, size_t amt)
+{
+	struct crashstash_rec *rec;
+	u64 pos;
+
+	rec = crashstash_percpu_reserve(cs, amt, &pos);
+	if (IS_ERR(rec))
+		return PTR_ERR(rec);
+	if (crashstash_store(cs, pos, NULL, data, amt)) {
+		smp_store_release(&rec->commit, CRASHSTASH_REC_INVALID);
+		return -EFAULT;
+	}
+	smp_store_release(&rec->commit, CRASHSTASH_REC_VALID);
+	return amt;
+}
+
+int crashstash_append(struct crashstash *cs, const void *data, size_t len)
+{
+	struct crashstash_rec *rec;
+	u64 pos;
+
+	/*
+	 * Where the architecture has no native 64-bit atomics, they are
+	 * emulated with spinlocks, which would deadlock if we interrupted one
+	 * of them.
+	 */
+	if (IS_ENABLED(CONFIG_GENERIC_ATOMIC64) && in_nmi())
+		return -EOPNOTSUPP;
+	if (WARN_ON_ONCE(!(cs->meta.flags & CRASHSTASH_F_PERCPU)))
+		return -EINVAL;
+
+	rec = crashstash_percpu_reserve(cs, len, &pos);
+	if (IS_ERR(rec))
+		return PTR_ERR(rec);
+	/* Every page is preallocated, so this only copies */
+	crashstash_store(cs, pos, data, NULL, len);
+	smp_store_release(&rec->commit, CRASHSTASH_REC_VALID);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(crashstash_append);
+
+struct crashstash_snap_ent {
+	u64 ts;
+	u64 pos;
+	u32 len;
+	u32 cpu;
+};
+
+static int crashstash_snap_cmp(const void *a, const void *b)
+{
+	const struct crashstash_snap_ent *x = a, *y = b;
+
+	if (x->ts == y->ts)
+		return 0;
+	return x->ts < y->ts ? -1 : 1;
+}
+
+/*
+ * Walk the committed records of one CPU's buffer, up to "end" if it is
+ * nonzero. If "ents" is provided, fill it in. Returns the number of valid
+ * records, and sets *end_out to the offset where we stopped.
+ */
+static size_t crashstash_percpu_walk(struct crashstash *cs, int cpu, u64 end, u64 *end_out,
+				     struct crashstash_snap_ent *ents, size_t *bytes)
+{
+	u64 cpu_size = cs->meta.cpu_size;
+	u64 base = cpu * cpu_size, off = 0;
+	struct crashstash_rec *rec;
+	size_t count = 0;
+	u32 commit;
+
+	if (!end)
+		end = min_t(u64, atomic64_read(per_cpu_ptr(cs->reserved, cpu)), cpu_size);
+	while (off + sizeof(*rec) <= end) {
+		rec = crashstash_ptr(cs, base + off);
+		commit = smp_load_acquire(&rec->commit);
+		if (!commit)
+			break;
+		if (commit == CRASHSTASH_REC_VALID) {
+			if (ents) {
+				ents[count].ts = rec->ts;
+				ents[count].pos = base + off + sizeof(*rec);
+				ents[count].len = rec->len;
+				ents[count].cpu = cpu;
+			}
+			*bytes += sizeof(struct crashstash_rec_out) + ALIGN(rec->len, 8);
+			count++;
+		}
+		off += sizeof(*rec) + ALIGN(rec->len, 8);
+	}
+	*end_out = off;
+	return count;
+}
+
+/*
+ * Build the merged, time-ordered view of a percpu stash for a reader. Writers
+ * may continue concurrently, so we first find where each CPU's committed
+ * records end, and then only look at records before that point.
+ */
+static int crashstash_percpu_snapshot(struct crashstash *cs)
+{
+	struct crashstash_snap_ent *ents = NULL;
+	struct crashstash_rec_out *out;
+	size_t count = 0, bytes = 0, i, n = 0;
+	u64 *ends;
+	void *snap;
+	int cpu, rv = 0;
+
+	ends = kcalloc(cs->meta.nr_cpus, sizeof(*ends), GFP_KERNEL);
+	if (!ends)
+		return -ENOMEM;
+	for (cpu = 0; cpu < cs->meta.nr_cpus; cpu++)
+		count += crashstash_percpu_walk(cs, cpu, 0, &ends[cpu], NULL, &bytes);
+
+	snap = kvmalloc(max_t(size_t, bytes, 1), GFP_KERNEL);
+	if (count)
+		ents = kvmalloc_array(count, sizeof(*ents), GFP_KERNEL);
+	if (!snap || (count && !ents)) {
+		kvfree(snap);
+		rv = -ENOMEM;
+		goto out;
+	}
+	bytes = 0;
+	for (cpu = 0; cpu < cs->meta.nr_cpus; cpu++)
+		if (ends[cpu])
+			n += crashstash_percpu_walk(cs, cpu, ends[cpu], &ends[cpu], ents + n, &bytes);
+	sort(ents, n, sizeof(*ents), crashstash_snap_cmp, NULL);
+
+	for (i = 0, bytes = 0; i < n; i++) {
+		out = snap + bytes;
+		out->ts = ents[i].ts;
+		out->len = ents[i].len;
+		out->cpu = ents[i].cpu;
+		crashstash_load(cs, ents[i].pos, snap + bytes + sizeof(*out), ents[i].len);
+		memset(snap + bytes + sizeof(*out) + ents[i].len, 0,
+		       ALIGN(ents[i].len, 8) - ents[i].len);
+		bytes += sizeof(*out) + ALIGN(ents[i].len, 8);
+	}
+	cs->snap = snap;
+	cs->snap_size = bytes;
+	proc_set_size(cs->pde, bytes);
+out:
+	kvfree(ents);
+	kfree(ends);
+	return rv;
+}
+
+#ifdef HAVE_LZ4
+static int crashstash_lz4_init(struct crashstash *cs)
+{
+	cs->stage = kvmalloc(CRASHSTASH_LZ4_CHUNK, GFP_KERNEL);
+	cs->lz4_buf = kvmalloc(LZ4_COMPRESSBOUND(CRASHSTASH_LZ4_CHUNK), GFP_KERNEL);
+	cs->lz4_wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+	if (!cs->stage || !cs->lz4_buf || !cs->lz4_wrkmem)
+		return -ENOMEM;
+	cs->meta.stage = (u64)cs->stage;
+	return 0;
+}
+
+/* Compress the staging buffer into a new chunk at the end of the stash */
+static int crashstash_lz4_flush(struct crashstash *cs)
+{
+	struct crashstash_lz4_hdr hdr;
+	int clen, rv;
+
+	BUG_ON(!mutex_is_locked(&cs->lock));
+	clen = LZ4_compress_default(cs->stage, cs->lz4_buf, cs->meta.stage_len,
+				    LZ4_COMPRESSBOUND(CRASHSTASH_LZ4_CHUNK), cs->lz4_wrkmem);
+	if (clen <= 0)
+		return -EIO;
+	if (cs->size + sizeof(hdr) + clen > cs->maxsize)
+		return -ENOSPC;
+	hdr.clen = clen;
+	hdr.ulen = cs->meta.stage_len;
+	rv = crashstash_store(cs, cs->size, &hdr, NULL, sizeof(hdr));
+	if (!rv)
+		rv = crashstash_store(cs, cs->size + sizeof(hdr), cs->lz4_buf, NULL, clen);
+	if (rv)
+		return rv;
+	/* If we crash in between, the chunk is just ignored */
+	cs->size += sizeof(hdr) + clen;
+	cs->meta.stage_len = 0;
+	crashstash_update_size(cs);
+	return 0;
+}
+
+static ssize_t crashstash_lz4_write(struct crashstash *cs, const char __user *data, size_t amt)
+{
+	size_t chunk_amt;
+	ssize_t written = 0;
+	int rv;
+
+	while (amt) {
+		/*
+		 * Compress only once there's more data to stage, so that the
+		 * last chunk stays in the staging buffer, and ENOSPC doesn't
+		 * lose any data which we already accepted.
+		 */
+		if (cs->meta.stage_len == CRASHSTASH_LZ4_CHUNK) {
+			rv = crashstash_lz4_flush(cs);
+			if (rv)
+				return written ? written : rv;
+		}
+		chunk_amt = min_t(size_t, amt, CRASHSTASH_LZ4_CHUNK - cs->meta.stage_len);
+		if (copy_from_user(cs->stage + cs->meta.stage_len, data, chunk_amt) != 0)
+			return written ? written : -EFAULT;
+		cs->meta.stage_len += chunk_amt;
+		written += chunk_amt;
+		data += chunk_amt;
+		amt -= chunk_amt;
+	}
+	return written;
+}
+
+/* Decompress the whole stash for a reader */
+static int crashstash_lz4_snapshot(struct crashstash *cs)
+{
+	struct crashstash_lz4_hdr hdr;
+	size_t total = cs->meta.stage_len, off = 0;
+	void *snap;
+	u64 pos;
+
+	for (pos = 0; pos < cs->size; pos += sizeof(hdr) + hdr.clen) {
+		crashstash_load(cs, pos, &hdr, sizeof(hdr));
+		if (hdr.clen > LZ4_COMPRESSBOUND(CRASHSTASH_LZ4_CHUNK) ||
+		    hdr.ulen > CRASHSTASH_LZ4_CHUNK || pos + sizeof(hdr) + hdr.clen > cs->size)
+			return -EIO;
+		total += hdr.ulen;
+	}
+	snap = kvmalloc(max_t(size_t, total, 1), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+	for (pos = 0; pos < cs->size; pos += sizeof(hdr) + hdr.clen) {
+		crashstash_load(cs, pos, &hdr, sizeof(hdr));
+		crashstash_load(cs, pos + sizeof(hdr), cs->lz4_buf, hdr.clen);
+		if (LZ4_decompress_safe(cs->lz4_buf, snap + off, hdr.clen, hdr.ulen) != hdr.ulen) {
+			kvfree(snap);
+			return -EIO;
+		}
+		off += hdr.ulen;
+	}
+	memcpy(snap + off, cs->stage, cs->meta.stage_len);
+	cs->snap = snap;
+	cs->snap_size = total;
+	proc_set_size(cs->pde, total);
+	return 0;
+}
+#else
+static int crashstash_lz4_init(struct crashstash *cs)
+{
+	return -EOPNOTSUPP;
+}
+
+static ssize_t crashstash_lz4_write(struct crashstash *cs, const char __user *data, size_t amt)
+{
+	return -EOPNOTSUPP;
+}
+
+static int crashstash_lz4_snapshot(struct crashstash *cs)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
 static ssize_t crashstash_write(struct file *f, const char __user *data, size_t amt, loff_t *off) {
 	size_t pgoff, chunk_amt;
 	void *dst;
 	ssize_t written = 0;
 	struct page *pg;
+	struct crashstash *cs = f->private_data;
+
+	if (cs->meta.flags & CRASHSTASH_F_PERCPU)
+		return amt ? crashstash_percpu_write(cs, data, amt) : 0;
 
 	/* We'll only allow writing at the end of the file */
-	mutex_lock(&crashstash_lock);
-	if (*off != size) {
-		mutex_unlock(&crashstash_lock);
+	mutex_lock(&cs->lock);
+	if (cs->mapped) {
+		/* The mapping is fixed size, writes go through it instead */
+		mutex_unlock(&cs->lock);
+		return -EBUSY;
+	}
+	if (cs->meta.flags & CRASHSTASH_F_RING) {
+		written = amt ? crashstash_ring_write(cs, data, amt) : 0;
+		mutex_unlock(&cs->lock);
+		return written;
+	}
+	if (cs->meta.flags & CRASHSTASH_F_LZ4) {
+		written = crashstash_lz4_write(cs, data, amt);
+		mutex_unlock(&cs->lock);
+		return written;
+	}
+	if (*off != cs->size) {
+		mutex_unlock(&cs->lock);
 		return -EINVAL;
 	}
 	/* Return ENOSPC when at capacity */
-	if (size >= MAXSIZE) {
-		mutex_unlock(&crashstash_lock);
+	if (cs->size >= cs->maxsize) {
+		mutex_unlock(&cs->lock);
 		return -ENOSPC;
 	}
 	/*
 	 * If the write would have us go beyond capacity, only write
 	 * up to the maximum amount of bytes.
 	 */
-	if (size + amt > MAXSIZE) {
-		amt = MAXSIZE - size;
+	if (cs->size + amt > cs->maxsize) {
+		amt = cs->maxsize - cs->size;
 	}
 
 	while (amt) {
 		pgoff = *off % PAGE_SIZE;
-		if (pgoff) {
-			BUG_ON(list_empty(&crashstash));
-			pg = list_last_entry(&crashstash, struct page, lru);
-		} else {
-			pg = alloc_page(GFP_KERNEL);
-			list_add_tail(&pg->lru, &crashstash);
-			pages++;
+		/* Allocates the next page, unless the stash is preallocated */
+		pg = crashstash_page(cs, *off);
+		if (!pg) {
+			if (!written)
+				written = -ENOMEM;
+			break;
 		}
 		dst = (void *)page_address(pg) + pgoff;
 		chunk_amt = min(amt, PAGE_SIZE - pgoff);
@@ -140,92 +832,665 @@ static ssize_t crashstash_write(struct file *f, const char __user *data, size_t
 		}
 		amt -= chunk_amt;
 		*off += chunk_amt;
-		size += chunk_amt;
+		cs->size += chunk_amt;
 		written += chunk_amt;
 		data += chunk_amt;
 	}
-	proc_set_size(pde, size);
-	mutex_unlock(&crashstash_lock);
+	crashstash_update_size(cs);
+	mutex_unlock(&cs->lock);
 
 	return written;
 }
 
-static ssize_t crashstash_read(struct file *f, char __user *data, size_t amt, loff_t *off)
+/*
+ * Reads are implemented with an iov_iter, so that splice() and sendfile() out of
+ * the stash work, and can take the pages directly rather than bouncing through
+ * a buffer.
+ */
+static ssize_t crashstash_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	struct page *pg;
-	size_t pgnum, pgoff, chunk_amt;
+	size_t pgoff, chunk_amt, copied;
+	size_t amt = iov_iter_count(to);
 	ssize_t read = 0;
-	void *src;
+	u64 pos;
+	loff_t *off = &iocb->ki_pos;
+	struct crashstash *cs = iocb->ki_filp->private_data;
 
 	/* Only read the amount we currently have */
-	mutex_lock(&crashstash_lock);
-	if (*off + amt > size)
-		amt = size - *off;
-
-	/* Seek to the correct page, don't bother with anything clever */
-	pgnum = *off / PAGE_SIZE;
-	pgoff = *off % PAGE_SIZE;
-	list_for_each_entry(pg, &crashstash, lru)
-	{
-		if (!pgnum)
-			break;
-		pgnum--;
+	mutex_lock(&cs->lock);
+	if (cs->meta.flags & (CRASHSTASH_F_PERCPU | CRASHSTASH_F_LZ4)) {
+		if (*off < cs->snap_size) {
+			amt = min_t(size_t, amt, cs->snap_size - *off);
+			read = copy_to_iter(cs->snap + *off, amt, to);
+			*off += read;
+			if (!read && amt)
+				read = -EFAULT;
+		}
+		mutex_unlock(&cs->lock);
+		return read;
 	}
+	if (*off >= cs->size) {
+		mutex_unlock(&cs->lock);
+		return 0;
+	}
+	if (*off + amt > cs->size)
+		amt = cs->size - *off;
 
-	/* Now we can read pages */
+	/*
+	 * Now we can read pages, looking each one up in the index. In ring
+	 * mode, offset zero of the file is the tail of the ring.
+	 */
 	while (amt) {
-		pgoff = *off % PAGE_SIZE;
+		pos = *off;
+		if (cs->meta.flags & CRASHSTASH_F_RING)
+			pos = (cs->meta.tail + pos) % cs->meta.capacity;
+		pg = cs->page_index[pos / PAGE_SIZE];
+		pgoff = pos % PAGE_SIZE;
 		chunk_amt = min(amt, PAGE_SIZE - pgoff);
-		src = (void *)page_address(pg) + pgoff;
-		if (copy_to_user(data, src, chunk_amt) != 0) {
-			read = -EFAULT;
+		copied = copy_page_to_iter(pg, pgoff, chunk_amt, to);
+		*off += copied;
+		amt -= copied;
+		read += copied;
+		/* Faulted, or the destination (e.g. a pipe) is full */
+		if (copied != chunk_amt) {
+			if (!read)
+				read = -EFAULT;
 			break;
 		}
-		pg = list_next_entry(pg, lru);
-		*off += chunk_amt;
-		amt -= chunk_amt;
-		read += chunk_amt;
-		data += chunk_amt;
 	}
 
-	mutex_unlock(&crashstash_lock);
+	mutex_unlock(&cs->lock);
 	return read;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0) && LINUX_VERSION_CODE < KERNEL_VERSION(5,10,0)
+/* proc_ops only gained proc_read_iter in 5.10 */
+static ssize_t crashstash_read(struct file *f, char __user *data, size_t amt, loff_t *off)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = amt };
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	ssize_t rv;
+
+	init_sync_kiocb(&kiocb, f);
+	kiocb.ki_pos = *off;
+	iov_iter_init(&iter, READ, &iov, 1, amt);
+	rv = crashstash_read_iter(&kiocb, &iter);
+	*off = kiocb.ki_pos;
+	return rv;
+}
+#endif
+
+/*
+ * Append the contents of another file, from its current position until EOF or
+ * until the stash is full. procfs has no write_iter() or splice_write(), so this
+ * is how to load a file into the stash without copying it through userspace.
+ * Only for ordinary stashes, since ring and percpu mode frame each write() as a
+ * record.
+ */
+static ssize_t crashstash_append_fd(struct file *filp, int fd)
+{
+	struct crashstash *cs = filp->private_data;
+	struct file *src;
+	struct page *pg;
+	void *bounce = NULL;
+	loff_t pos;
+	size_t pgoff, chunk_amt;
+	ssize_t rv = 0, appended = 0;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (cs->meta.flags & (CRASHSTASH_F_RING | CRASHSTASH_F_PERCPU | CRASHSTASH_F_LZ4))
+		return -EINVAL;
+	src = fget(fd);
+	if (!src)
+		return -EBADF;
+	/*
+	 * We read while holding cs->lock, so only regular files: a pipe or socket
+	 * could block forever. Reading a stash would take its lock under ours, and
+	 * deadlock if it's ours or it's appending from us.
+	 */
+	if (!S_ISREG(file_inode(src)->i_mode) || src->f_op == filp->f_op) {
+		fput(src);
+		return -EINVAL;
+	}
+
+	rv = mutex_lock_interruptible(&cs->lock);
+	if (rv) {
+		fput(src);
+		return rv;
+	}
+	if (cs->mapped) {
+		rv = -EBUSY;
+		goto out;
+	}
+	pos = src->f_pos;
+	while (cs->size < cs->maxsize) {
+		pgoff = cs->size % PAGE_SIZE;
+		chunk_amt = min_t(u64, PAGE_SIZE - pgoff, cs->maxsize - cs->size);
+		if (cs->size / PAGE_SIZE < cs->pages) {
+			pg = cs->page_index[cs->size / PAGE_SIZE];
+			rv = kernel_read(src, page_address(pg) + pgoff, chunk_amt, &pos);
+		} else {
+			/*
+			 * Don't allocate a page until there's data for it, or an
+			 * append at EOF would leave one past the end of the stash.
+			 */
+			if (!bounce) {
+				bounce = (void *)__get_free_page(GFP_KERNEL);
+				if (!bounce) {
+					rv = -ENOMEM;
+					break;
+				}
+			}
+			rv = kernel_read(src, bounce, chunk_amt, &pos);
+			if (rv > 0) {
+				pg = crashstash_page(cs, cs->size);
+				if (!pg) {
+					rv = -ENOMEM;
+					break;
+				}
+				memcpy(page_address(pg), bounce, rv);
+			}
+		}
+		if (rv <= 0)
+			break;
+		/* Only consume from the source what actually made it into the stash */
+		src->f_pos = pos;
+		cs->size += rv;
+		appended += rv;
+		if (fatal_signal_pending(current))
+			break;
+	}
+	crashstash_update_size(cs);
+	/* Keep our own position at the end, so that write() can carry on from it */
+	filp->f_pos = cs->size;
+out:
+	mutex_unlock(&cs->lock);
+	free_page((unsigned long)bounce);
+	fput(src);
+	return appended ? appended : rv;
+}
+
+static long crashstash_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case CRASHSTASH_IOC_APPEND_FD:
+		return crashstash_append_fd(filp, (int)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Append "count" zeroed pages to an empty stash. On failure, the caller frees. */
+static int crashstash_prealloc(struct crashstash *cs, u64 count)
+{
+	int rv;
+
+	if (WARN_ON_ONCE(cs->pages))
+		return -EBUSY;
+	while (cs->pages < count) {
+		rv = crashstash_alloc_chunk(cs, count - cs->pages, GFP_KERNEL | __GFP_ZERO);
+		if (rv)
+			return rv;
+	}
+	return 0;
+}
+
+/*
+ * Map the stash into userspace, so that it can be updated with plain stores
+ * rather than write() calls. The stash must be empty (i.e. freshly opened for
+ * O_RDWR), and the size of the mapping becomes the size of the stash. We
+ * allocate and map all of the pages up front. They remain ordinary kernel pages
+ * on our list, so they get included in the vmcore just like written data.
+ */
+static int crashstash_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long i;
+	int rv = 0;
+	struct crashstash *cs = filp->private_data;
+
+	if ((filp->f_flags & O_ACCMODE) != O_RDWR)
+		return -EACCES;
+	if (cs->meta.flags & (CRASHSTASH_F_RING | CRASHSTASH_F_PERCPU | CRASHSTASH_F_LZ4))
+		return -EINVAL;
+	/* A private mapping would just copy-on-write away from our pages */
+	if (!(vma->vm_flags & VM_SHARED) || vma->vm_pgoff)
+		return -EINVAL;
+	if (len > cs->maxsize)
+		return -ENOSPC;
+
+	mutex_lock(&cs->lock);
+	/*
+	 * A failed write() can leave an ordinary stash with pages but no size.
+	 * Those would be past the end of the mapping, so refuse rather than
+	 * sort out which of them we could reuse.
+	 */
+	if (cs->size || cs->mapped ||
+	    (!(cs->meta.flags & CRASHSTASH_F_PREALLOC) && cs->pages)) {
+		rv = -EBUSY;
+		goto out;
+	}
+	if (cs->meta.flags & CRASHSTASH_F_PREALLOC) {
+		/* Our own pages were zeroed, but these may have old contents */
+		for (i = 0; i < len / PAGE_SIZE; i++)
+			clear_page(page_address(cs->page_index[i]));
+	} else {
+		rv = crashstash_prealloc(cs, len / PAGE_SIZE);
+		if (rv)
+			goto out_free;
+	}
+	/*
+	 * vm_insert_page() takes its own reference to each page. So if the
+	 * stash is cleared while still mapped, or if we fail partway, the pages
+	 * don't get freed until they're unmapped too.
+	 */
+	for (i = 0; i < len / PAGE_SIZE; i++) {
+		rv = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE, cs->page_index[i]);
+		if (rv)
+			goto out_free;
+	}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+	vma->vm_flags |= VM_DONTEXPAND;
+#else
+	vm_flags_set(vma, VM_DONTEXPAND);
+#endif
+	cs->size = len;
+	cs->mapped = true;
+	crashstash_update_size(cs);
+	goto out;
+
+out_free:
+	crashstash_clear(cs);
+out:
+	mutex_unlock(&cs->lock);
+	return rv;
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
 static const struct file_operations crashstash_fops = {
 	.owner                  = THIS_MODULE,
-	.read                   = crashstash_read,
+	.read_iter              = crashstash_read_iter,
+	.splice_read            = generic_file_splice_read,
 	.write                  = crashstash_write,
+	.mmap                   = crashstash_mmap,
+	.unlocked_ioctl         = crashstash_ioctl,
+	.compat_ioctl           = crashstash_ioctl,
 	.open                   = crashstash_open,
 	.release                = crashstash_release,
 };
 #else
 static const struct proc_ops crashstash_fops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,10,0)
 	.proc_read              = crashstash_read,
+#else
+	/* procfs provides splice_read for us */
+	.proc_read_iter         = crashstash_read_iter,
+#endif
 	.proc_write             = crashstash_write,
+	.proc_mmap              = crashstash_mmap,
+	.proc_ioctl             = crashstash_ioctl,
+#ifdef CONFIG_COMPAT
+	.proc_compat_ioctl      = crashstash_ioctl,
+#endif
 	.proc_open              = crashstash_open,
 	.proc_release           = crashstash_release,
 };
 #endif
 
+static bool crashstash_name_valid(const char *name)
+{
+	const char *c;
+
+	if (!*name || strlen(name) >= CRASHSTASH_NAME_MAX)
+		return false;
+	if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, "control"))
+		return false;
+	for (c = name; *c; c++)
+		if (!isalnum(*c) && *c != '_' && *c != '-' && *c != '.')
+			return false;
+	return true;
+}
+
+/* Must hold crashstash_list_lock */
+static struct crashstash *crashstash_lookup(const char *name)
+{
+	struct crashstash *cs;
+
+	list_for_each_entry(cs, &crashstash_list, node)
+		if (!strcmp(cs->name, name))
+			return cs;
+	return NULL;
+}
+
+/* CRC32, compatible with zlib's crc32() */
+static u32 crashstash_checksum(const void *data, size_t len)
+{
+	return crc32_le(~0, data, len) ^ ~0;
+}
+
+/*
+ * The descriptor describes where everything is, which doesn't change, so it is
+ * written once. It gets a page to itself, so that the magic is page-aligned.
+ */
+static int crashstash_desc_init(struct crashstash *cs)
+{
+	struct crashstash_desc *desc;
+
+	BUILD_BUG_ON(sizeof(CRASHSTASH_DESC_MAGIC) != sizeof(desc->magic));
+	desc = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!desc)
+		return -ENOMEM;
+	memcpy(desc->magic, CRASHSTASH_DESC_MAGIC, sizeof(desc->magic));
+	desc->version = CRASHSTASH_DESC_VERSION;
+	strscpy(desc->name, cs->name, sizeof(desc->name));
+	desc->list = (u64)&cs->list;
+	desc->size = (u64)&cs->size;
+	desc->pages = (u64)&cs->pages;
+	desc->meta = (u64)&cs->meta;
+	desc->self_phys = virt_to_phys(desc);
+	desc->self_page = (u64)virt_to_page(desc);
+	desc->checksum = crashstash_checksum(desc, sizeof(*desc));
+	cs->desc = desc;
+	return 0;
+}
+
+static void crashstash_destroy(struct crashstash *cs)
+{
+	mutex_lock(&cs->lock);
+	crashstash_free(cs);
+	mutex_unlock(&cs->lock);
+	/* Don't let a memory scan find the stale descriptor in a freed page */
+	if (cs->desc) {
+		memset(cs->desc, 0, sizeof(*cs->desc));
+		free_page((unsigned long)cs->desc);
+	}
+	free_percpu(cs->reserved);
+	kvfree(cs->snap);
+	kvfree(cs->stage);
+	kvfree(cs->lz4_buf);
+	kvfree(cs->lz4_wrkmem);
+	kvfree(cs->page_index);
+	kfree(cs);
+}
+
+int crashstash_create(const char *name, u64 flags, u64 maxsize)
+{
+	struct crashstash *cs;
+	u64 maxpages = DIV_ROUND_UP(maxsize, PAGE_SIZE);
+	int rv = 0;
+
+	if (!crashstash_name_valid(name))
+		return -EINVAL;
+	if (!maxsize || maxsize > capacity)
+		return -EINVAL;
+	if ((flags & CRASHSTASH_F_PERCPU) && (flags & (CRASHSTASH_F_RING | CRASHSTASH_F_PREALLOC)))
+		return -EINVAL;
+	/* Each CPU gets a whole number of pages */
+	if ((flags & CRASHSTASH_F_PERCPU) && maxpages < nr_cpu_ids)
+		return -EINVAL;
+	if ((flags & CRASHSTASH_F_LZ4) && (flags & (CRASHSTASH_F_RING | CRASHSTASH_F_PERCPU)))
+		return -EINVAL;
+#ifndef HAVE_LZ4
+	if (flags & CRASHSTASH_F_LZ4)
+		return -EOPNOTSUPP;
+#endif
+
+	cs = kzalloc(sizeof(*cs), GFP_KERNEL);
+	if (!cs)
+		return -ENOMEM;
+	cs->page_index = kvcalloc(maxpages, sizeof(struct page *), GFP_KERNEL);
+	if (!cs->page_index) {
+		kfree(cs);
+		return -ENOMEM;
+	}
+	strscpy(cs->name, name, sizeof(cs->name));
+	mutex_init(&cs->lock);
+	INIT_LIST_HEAD(&cs->list);
+	ratelimit_state_init(&cs->ratelimit, DEFAULT_RATELIMIT_INTERVAL,
+			     DEFAULT_RATELIMIT_BURST);
+	cs->maxsize = maxsize;
+	cs->meta.capacity = maxpages * PAGE_SIZE;
+	/* Percpu stashes are always preallocated, but don't use the flag */
+	if (prealloc && !(flags & CRASHSTASH_F_PERCPU))
+		flags |= CRASHSTASH_F_PREALLOC;
+	cs->meta.flags = flags;
+	rv = crashstash_desc_init(cs);
+	if (rv) {
+		crashstash_destroy(cs);
+		return rv;
+	}
+	if (flags & CRASHSTASH_F_PREALLOC) {
+		mutex_lock(&cs->lock);
+		rv = crashstash_prealloc(cs, maxpages);
+		mutex_unlock(&cs->lock);
+		if (rv) {
+			crashstash_destroy(cs);
+			return rv;
+		}
+	}
+	if (flags & CRASHSTASH_F_LZ4) {
+		rv = crashstash_lz4_init(cs);
+		if (rv) {
+			crashstash_destroy(cs);
+			return rv;
+		}
+	} else if (flags & CRASHSTASH_F_PERCPU) {
+		cs->meta.nr_cpus = nr_cpu_ids;
+		cs->meta.cpu_size = maxpages / nr_cpu_ids * PAGE_SIZE;
+		cs->meta.capacity = cs->meta.cpu_size * nr_cpu_ids;
+		cs->reserved = alloc_percpu(atomic64_t);
+		mutex_lock(&cs->lock);
+		rv = cs->reserved ? crashstash_prealloc(cs, cs->meta.capacity / PAGE_SIZE) : -ENOMEM;
+		mutex_unlock(&cs->lock);
+		if (rv) {
+			crashstash_destroy(cs);
+			return rv;
+		}
+	}
+
+	mutex_lock(&crashstash_list_lock);
+	if (crashstash_lookup(name)) {
+		rv = -EEXIST;
+		goto out;
+	}
+	cs->pde = proc_create_data(name, 0600, crashstash_dir, &crashstash_fops, cs);
+	if (!cs->pde) {
+		rv = -ENOMEM;
+		goto out;
+	}
+	list_add_tail(&cs->node, &crashstash_list);
+	crashstash_update_size(cs);
+out:
+	mutex_unlock(&crashstash_list_lock);
+	if (rv)
+		crashstash_destroy(cs);
+	return rv;
+}
+EXPORT_SYMBOL_GPL(crashstash_create);
+
+/*
+ * In-kernel users hold a stash open just like a writer process does, which
+ * keeps it from being removed.
+ */
+struct crashstash *crashstash_get(const char *name)
+{
+	struct crashstash *cs;
+
+	mutex_lock(&crashstash_list_lock);
+	cs = crashstash_lookup(name);
+	if (!cs) {
+		cs = ERR_PTR(-ENOENT);
+		goto out;
+	}
+	if (!(cs->meta.flags & CRASHSTASH_F_PERCPU)) {
+		cs = ERR_PTR(-EINVAL);
+		goto out;
+	}
+	mutex_lock(&cs->lock);
+	cs->count++;
+	crashstash_log(cs);
+	mutex_unlock(&cs->lock);
+out:
+	mutex_unlock(&crashstash_list_lock);
+	return cs;
+}
+EXPORT_SYMBOL_GPL(crashstash_get);
+
+void crashstash_put(struct crashstash *cs)
+{
+	mutex_lock(&cs->lock);
+	BUG_ON(cs->count <= 0);
+	cs->count--;
+	mutex_unlock(&cs->lock);
+}
+EXPORT_SYMBOL_GPL(crashstash_put);
+
+static int crashstash_remove(const char *name)
+{
+	struct crashstash *cs;
+
+	mutex_lock(&crashstash_list_lock);
+	cs = crashstash_lookup(name);
+	if (!cs) {
+		mutex_unlock(&crashstash_list_lock);
+		return -ENOENT;
+	}
+	mutex_lock(&cs->lock);
+	if (cs->count) {
+		mutex_unlock(&cs->lock);
+		mutex_unlock(&crashstash_list_lock);
+		return -EBUSY;
+	}
+	list_del(&cs->node);
+	mutex_unlock(&cs->lock);
+	mutex_unlock(&crashstash_list_lock);
+
+	/*
+	 * If somebody opened the file since we checked, proc_remove() waits
+	 * for any call in progress and then releases the file for them.
+	 */
+	proc_remove(cs->pde);
+	crashstash_destroy(cs);
+	/* Let crashstash.py know that earlier log messages for it are stale */
+	pr_info("crashstash: REMOVED: %s\n", name);
+	return 0;
+}
+
+static char *next_token(char **cur)
+{
+	char *tok;
+
+	do {
+		tok = strsep(cur, " \t\n");
+	} while (tok && !*tok);
+	return tok;
+}
+
+/*
+ * Stashes are created and removed by writing commands to
+ * /proc/crashstash/control:
+ *
+ *   create NAME [ring|percpu|lz4] [prealloc] [size=BYTES]
+ *   remove NAME
+ */
+static ssize_t crashstash_control_write(struct file *f, const char __user *data,
+					size_t amt, loff_t *off)
+{
+	char buf[128], *cur = buf, *cmd, *name, *opt;
+	u64 flags = 0, maxsize = capacity;
+	int rv;
+
+	if (amt >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, data, amt) != 0)
+		return -EFAULT;
+	buf[amt] = '\0';
+
+	cmd = next_token(&cur);
+	name = next_token(&cur);
+	if (!cmd || !name)
+		return -EINVAL;
+
+	if (!strcmp(cmd, "create")) {
+		while ((opt = next_token(&cur))) {
+			if (!strcmp(opt, "ring"))
+				flags |= CRASHSTASH_F_RING;
+			else if (!strcmp(opt, "percpu"))
+				flags |= CRASHSTASH_F_PERCPU;
+			else if (!strcmp(opt, "prealloc"))
+				flags |= CRASHSTASH_F_PREALLOC;
+			else if (!strcmp(opt, "lz4"))
+				flags |= CRASHSTASH_F_LZ4;
+			else if (!strncmp(opt, "size=", 5))
+				maxsize = memparse(opt + 5, NULL);
+			else
+				return -EINVAL;
+		}
+		rv = crashstash_create(name, flags, maxsize);
+	} else if (!strcmp(cmd, "remove")) {
+		if (next_token(&cur))
+			return -EINVAL;
+		rv = crashstash_remove(name);
+	} else {
+		rv = -EINVAL;
+	}
+	return rv ? rv : amt;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+static const struct file_operations crashstash_control_fops = {
+	.owner                  = THIS_MODULE,
+	.write                  = crashstash_control_write,
+};
+#else
+static const struct proc_ops crashstash_control_fops = {
+	.proc_write             = crashstash_control_write,
+};
+#endif
+
 static int crashstash_init(void)
 {
-	pde = proc_create("crashstash", 0600, NULL, &crashstash_fops);
-	if (!pde) {
+	int rv;
+
+	memcpy(crashstash_descriptor.magic, CRASHSTASH_ROOT_MAGIC, sizeof(crashstash_descriptor.magic));
+	crashstash_descriptor.version = CRASHSTASH_DESC_VERSION;
+	crashstash_descriptor.list = (u64)&crashstash_list;
+	crashstash_descriptor.node_offset = offsetof(struct crashstash, node);
+	crashstash_descriptor.desc_offset = offsetof(struct crashstash, desc);
+	crashstash_descriptor.checksum = crashstash_checksum(&crashstash_descriptor,
+							     sizeof(crashstash_descriptor));
+
+	crashstash_dir = proc_mkdir("crashstash", NULL);
+	if (!crashstash_dir)
 		return -ENOENT;
+	if (!proc_create("control", 0200, crashstash_dir, &crashstash_control_fops)) {
+		rv = -ENOENT;
+		goto err;
 	}
+	rv = crashstash_create("default", ring ? CRASHSTASH_F_RING : 0, capacity);
+	if (rv)
+		goto err;
 	pr_info("crashstash: successfully initialized\n");
 	return 0;
+err:
+	proc_remove(crashstash_dir);
+	return rv;
 }
 
 static void crashstash_exit(void)
 {
-	proc_remove(pde);
-	pde = NULL;
-	mutex_lock(&crashstash_lock);
-	crashstash_free();
-	mutex_unlock(&crashstash_lock);
+	struct crashstash *cs, *next;
+
+	/* Removes every stash file, and releases any which are still open */
+	proc_remove(crashstash_dir);
+	crashstash_dir = NULL;
+	list_for_each_entry_safe(cs, next, &crashstash_list, node) {
+		list_del(&cs->node);
+		crashstash_destroy(cs);
+	}
 	pr_info("crashstash: exited\n");
 }
 
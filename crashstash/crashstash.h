@@ -0,0 +1,107 @@
+/*
+ * In-kernel interface to the crashstash module, for other modules which want to
+ * record binary state that survives into a vmcore.
+ *
+ *   static struct crashstash *cs;
+ *
+ *   crashstash_create("mydriver", CRASHSTASH_F_PERCPU, SZ_4M);
+ *   cs = crashstash_get("mydriver");
+ *   ...
+ *   crashstash_append(cs, &state, sizeof(state));   // any context, even NMI
+ *   ...
+ *   crashstash_put(cs);
+ *
+ * Only percpu stashes may be appended to, since they are preallocated and need
+ * no lock. The records appear in /proc/crashstash/NAME and in vmcores exactly as
+ * if they had been written from userspace.
+ *
+ * The flags, ioctls and descriptor layouts may also be used from userspace.
+ */
+#ifndef _CRASHSTASH_H
+#define _CRASHSTASH_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Stash flags, which are also stored in struct crashstash_meta */
+#define CRASHSTASH_F_RING (1 << 0)
+#define CRASHSTASH_F_PERCPU (1 << 1)
+#define CRASHSTASH_F_PREALLOC (1 << 2)
+#define CRASHSTASH_F_LZ4 (1 << 3)
+
+/*
+ * Append the file descriptor given as the argument, from its current position to
+ * EOF (or until the stash is full), to a stash which is open for writing. The
+ * source must be a regular file. Returns the number of bytes appended.
+ */
+#define CRASHSTASH_IOC_APPEND_FD _IO(0xCA, 1)
+
+/*
+ * Descriptors let vmcore analysis find the stashes without relying on the
+ * kernel log. The global symbol "crashstash_descriptor" is a struct
+ * crashstash_root, and each stash has a struct crashstash_desc at the start of
+ * its own page, so a tool without symbols can also find them by scanning
+ * memory for page-aligned magic. All addresses are kernel virtual addresses,
+ * and all fields are in the kernel's byte order. The checksum is the CRC32
+ * (as computed by zlib) of the structure, with the checksum field zeroed.
+ */
+#define CRASHSTASH_NAME_MAX 32
+#define CRASHSTASH_DESC_VERSION 2
+#define CRASHSTASH_ROOT_MAGIC "CRASHSTASH-ROOT"  /* 16 bytes, with the NUL */
+#define CRASHSTASH_DESC_MAGIC "CRASHSTASH-DESC"
+
+struct crashstash_root {
+	char magic[16];
+	__u32 version;
+	__u32 checksum;
+	__u64 list;         /* address of the list_head of all stashes */
+	__u64 node_offset;  /* offset of that list's node in each stash */
+	__u64 desc_offset;  /* offset of the pointer to each stash's descriptor */
+};
+
+struct crashstash_desc {
+	char magic[16];
+	__u32 version;
+	__u32 checksum;
+	char name[CRASHSTASH_NAME_MAX];
+	__u64 list;   /* address of the list_head of the stash's chunks */
+	__u64 size;   /* address of the u64 stash size */
+	__u64 pages;  /* address of the u64 page count */
+	__u64 meta;   /* address of the struct crashstash_meta */
+	/*
+	 * Version 2: the physical address of this descriptor, and the address
+	 * of its struct page. Together with SIZE(page) from vmcoreinfo, these
+	 * give the base of the (linear) memory map, so that tools can convert
+	 * the stash's struct page addresses to physical addresses.
+	 */
+	__u64 self_phys;
+	__u64 self_page;
+};
+
+#ifdef __KERNEL__
+
+struct crashstash;
+
+/*
+ * Create a stash, just like the "create" control command. Returns -EEXIST if
+ * there is already a stash with this name. May sleep.
+ */
+int crashstash_create(const char *name, u64 flags, u64 maxsize);
+
+/*
+ * Find a percpu stash, and hold it open until crashstash_put(), so that it
+ * can't be removed. Returns an ERR_PTR() on failure. May sleep.
+ */
+struct crashstash *crashstash_get(const char *name);
+void crashstash_put(struct crashstash *cs);
+
+/*
+ * Append one record to the stash. Lockless and safe in any context, including
+ * hard IRQ and NMI. Returns 0 on success, or -ENOSPC once the current CPU's
+ * buffer is full.
+ */
+int crashstash_append(struct crashstash *cs, const void *data, size_t len);
+
+#endif /* __KERNEL__ */
+
+#endif /* _CRASHSTASH_H */
@@ -1,43 +1,417 @@
 #!/usr/bin/env python3
-import math
+import argparse
 import re
+import struct
+import time
+import zlib
+from typing import BinaryIO
+from typing import Dict
+from typing import Iterator
+from typing import List
+from typing import Optional
+from typing import Tuple
 
 from drgn import Object
+from drgn import PlatformFlags
 from drgn import Program
 from drgn.helpers.linux.list import list_for_each_entry
 from drgn.helpers.linux.printk import get_printk_records
 from drgn.helpers.linux.mm import page_to_virt
 
+# Flags in struct crashstash_meta
+CRASHSTASH_F_RING = 1 << 0
+CRASHSTASH_F_PERCPU = 1 << 1
+CRASHSTASH_F_PREALLOC = 1 << 2
+CRASHSTASH_F_LZ4 = 1 << 3
 
-def get_crashstash(prog: Program) -> bytes:
+# commit values for struct crashstash_rec
+CRASHSTASH_REC_VALID = 1
+
+# struct crashstash_root and struct crashstash_desc, from crashstash.h
+CRASHSTASH_ROOT_MAGIC = b"CRASHSTASH-ROOT\0"
+CRASHSTASH_DESC_MAGIC = b"CRASHSTASH-DESC\0"
+# by version: the root is unchanged, the descriptor gained two fields in v2
+_ROOT_FMT = {1: "16sIIQQQ", 2: "16sIIQQQ"}
+_DESC_FMT = {1: "16sII32sQQQQ", 2: "16sII32sQQQQQQ"}
+
+
+def _read_descriptor(
+    prog: Program, addr: int, fmts: Dict[int, str], magic: bytes
+) -> Optional[tuple]:
+    """
+    Read and unpack a descriptor at addr, returning None unless its magic,
+    version and checksum are valid.
+    """
+    order = "<" if _byteorder(prog) == "little" else ">"
+    magic_read, version = struct.unpack(order + "16sI", prog.read(addr, 20))
+    if magic_read != magic or version not in fmts:
+        return None
+    fmt = order + fmts[version]
+    raw = prog.read(addr, struct.calcsize(fmt))
+    fields = struct.unpack(fmt, raw)
+    zeroed = raw[:20] + bytes(4) + raw[24:]
+    if zlib.crc32(zeroed) != fields[2]:
+        return None
+    return fields
+
+
+def _find_crashstashes_by_descriptor(
+    prog: Program,
+) -> Optional[Dict[str, Dict[str, int]]]:
+    """
+    Find every stash from the crashstash_descriptor symbol, without needing the
+    module's debuginfo or the kernel log. Returns None if the module doesn't
+    have descriptors (or they are corrupt).
+    """
+    try:
+        root_addr = prog.symbol("crashstash_descriptor").address
+    except LookupError:
+        return None
+    root = _read_descriptor(prog, root_addr, _ROOT_FMT, CRASHSTASH_ROOT_MAGIC)
+    if root is None:
+        return None
+    _, _, _, list_addr, node_offset, desc_offset = root
+
+    def read_ptr(addr: int) -> int:
+        return Object(prog, "unsigned long", address=addr).value_()
+
+    stashes = {}
+    node = read_ptr(list_addr)
+    while node != list_addr:
+        desc_addr = read_ptr(node - node_offset + desc_offset)
+        desc = _read_descriptor(prog, desc_addr, _DESC_FMT, CRASHSTASH_DESC_MAGIC)
+        if desc is None:
+            return None
+        name = desc[3].split(b"\0", 1)[0].decode()
+        stashes[name] = dict(zip(("STASH", "SIZE", "PAGES", "META"), desc[4:8]))
+        node = read_ptr(node)
+        if len(stashes) > 100000:
+            raise Exception("crashstash list appears to be corrupt")
+    return stashes
+
+
+def _find_crashstashes(prog: Program) -> Dict[str, Dict[str, int]]:
+    """
+    Find the stashes from their descriptors, if possible. Otherwise, search
+    the kernel log for the most recent message describing each stash,
+    ignoring any stash which has since been removed. Messages from older
+    versions of the module have no NAME, and are treated as "default".
+    """
+    stashes = _find_crashstashes_by_descriptor(prog)
+    if stashes is not None:
+        return stashes
     log = get_printk_records(prog)
     log.sort(key=lambda l: l.timestamp)
     expr = re.compile(
-        rb"crashstash: STASH: (?P<STASH>[a-fA-F0-9]+) "
+        rb"crashstash: (NAME: (?P<NAME>\S+) )?"
+        rb"STASH: (?P<STASH>[a-fA-F0-9]+) "
         rb"SIZE: (?P<SIZE>[a-fA-F0-9]+) "
         rb"PAGES: (?P<PAGES>[a-fA-F0-9]+)"
+        rb"( META: (?P<META>[a-fA-F0-9]+))?"
+        rb"( DESC: [a-fA-F0-9]+)?"
     )
-    for rec in reversed(log):
+    removed = re.compile(rb"crashstash: REMOVED: (?P<NAME>\S+)")
+    stashes = {}
+    for rec in log:
         match = expr.fullmatch(rec.text)
         if match:
+            name = (match.group("NAME") or b"default").decode()
+            stashes[name] = {
+                k: int(match.group(k), 16)
+                for k in ("STASH", "SIZE", "PAGES", "META")
+                if match.group(k)
+            }
+            continue
+        match = removed.fullmatch(rec.text)
+        if match:
+            stashes.pop(match.group("NAME").decode(), None)
+    return stashes
+
+
+def _byteorder(prog: Program) -> str:
+    if prog.platform.flags & PlatformFlags.IS_LITTLE_ENDIAN:
+        return "little"
+    return "big"
+
+
+def _merge_percpu(
+    prog: Program, storage: bytes, nr_cpus: int, cpu_size: int
+) -> bytes:
+    """
+    Collect the committed records from each CPU's buffer, and return them in
+    timestamp order, in the same format that reading the proc file produces.
+    """
+    byteorder = _byteorder(prog)
+    recs = []
+    for cpu in range(nr_cpus):
+        buf = storage[cpu * cpu_size:(cpu + 1) * cpu_size]
+        off = 0
+        while off + 16 <= len(buf):
+            ts = int.from_bytes(buf[off:off + 8], byteorder)
+            length = int.from_bytes(buf[off + 8:off + 12], byteorder)
+            commit = int.from_bytes(buf[off + 12:off + 16], byteorder)
+            if not commit:
+                # Never written, or still being written at the crash
+                break
+            if commit == CRASHSTASH_REC_VALID:
+                recs.append((ts, cpu, buf[off + 16:off + 16 + length]))
+            off += 16 + (length + 7) // 8 * 8
+    recs.sort(key=lambda r: r[0])
+    data = []
+    for ts, cpu, rec in recs:
+        data.append(ts.to_bytes(8, byteorder))
+        data.append(len(rec).to_bytes(4, byteorder))
+        data.append(cpu.to_bytes(4, byteorder))
+        data.append(rec + bytes(-len(rec) % 8))
+    return b"".join(data)
+
+
+def _decompress_lz4(stash: "_Stash") -> Iterator[bytes]:
+    """
+    Decompress the chunks of an lz4 mode stash. Each is a u32 compressed
+    length and u32 uncompressed length, followed by the compressed data.
+    """
+    import lz4.block
+
+    byteorder = _byteorder(stash.prog)
+    off = 0
+    while off + 8 <= stash.size:
+        hdr = stash.read(off, 8)
+        clen = int.from_bytes(hdr[:4], byteorder)
+        ulen = int.from_bytes(hdr[4:], byteorder)
+        if off + 8 + clen > stash.size:
+            raise Exception("Truncated lz4 chunk in crashstash")
+        yield lz4.block.decompress(stash.read(off + 8, clen), uncompressed_size=ulen)
+        off += 8 + clen
+
+
+class _Stash:
+    """
+    The metadata of one stash, read and validated up front, along with its
+    storage as a list of physically contiguous (address, length) extents.
+    """
+
+    # Large enough to amortize the per-read cost, small enough to stream
+    MAX_READ = 16 << 20
+
+    def __init__(self, prog: Program, addrs: Dict[str, int]) -> None:
+        self.prog = prog
+        head = Object(prog, "struct list_head *", value=addrs["STASH"])
+        self.size = Object(prog, "u64", address=addrs["SIZE"]).value_()
+        page_count = Object(prog, "u64", address=addrs["PAGES"]).value_()
+
+        # struct crashstash_meta: flags, head, tail, capacity,
+        # [nr_cpus, cpu_size, [stage, stage_len]]
+        self.flags = self.ring_tail = self.capacity = 0
+        if "META" in addrs:
+            self.flags, _, self.ring_tail, self.capacity = (
+                Object(prog, "u64", address=addrs["META"] + 8 * i).value_()
+                for i in range(4)
+            )
+        known = (
+            CRASHSTASH_F_RING | CRASHSTASH_F_PERCPU
+            | CRASHSTASH_F_PREALLOC | CRASHSTASH_F_LZ4
+        )
+        if self.flags & ~known:
+            raise Exception(f"Unknown crashstash flags {self.flags:#x}")
+
+        # Each list entry is the first page of a physically contiguous chunk
+        # of 2^order pages, with the order in page->private. (Older versions
+        # of the module always used single pages, with private zero.)
+        # Adjacent chunks are often contiguous too, so merge them.
+        PAGE_SIZE = prog["PAGE_SIZE"].value_()
+        self.extents: List[Tuple[int, int]] = []
+        for page in list_for_each_entry("struct page", head, "lru"):
+            addr = page_to_virt(page).value_()
+            length = PAGE_SIZE << page.private.value_()
+            if self.extents and sum(self.extents[-1]) == addr:
+                self.extents[-1] = (self.extents[-1][0], self.extents[-1][1] + length)
+            else:
+                self.extents.append((addr, length))
+        self.storage = sum(length for _, length in self.extents)
+        if self.storage != page_count * PAGE_SIZE:
+            raise Exception("Inconsistent page count for crashstash")
+
+        if self.flags & CRASHSTASH_F_PERCPU:
+            self.nr_cpus, self.cpu_size = (
+                Object(prog, "u64", address=addrs["META"] + 8 * i).value_()
+                for i in range(4, 6)
+            )
+            if (
+                self.nr_cpus * self.cpu_size != self.capacity
+                or self.capacity > self.storage
+            ):
+                raise Exception("Inconsistent metadata for percpu crashstash")
+        elif self.size > self.storage:
+            raise Exception("Inconsistent metadata for crashstash size")
+        if self.flags & CRASHSTASH_F_RING and not self.capacity:
+            raise Exception("Inconsistent metadata for crashstash ring")
+        if self.flags & CRASHSTASH_F_LZ4:
+            self.stage, self.stage_len = (
+                Object(prog, "u64", address=addrs["META"] + 8 * i).value_()
+                for i in range(6, 8)
+            )
+            if self.stage_len > 64 * 1024:
+                raise Exception("Inconsistent metadata for lz4 crashstash")
+
+    def read_range(self, off: int, length: int) -> Iterator[bytes]:
+        """Yield the storage from "off" for "length" bytes, in large pieces"""
+        for addr, extent_len in self.extents:
+            if off >= extent_len:
+                off -= extent_len
+                continue
+            while length > 0 and off < extent_len:
+                amt = min(length, extent_len - off, self.MAX_READ)
+                yield self.prog.read(addr + off, amt)
+                off += amt
+                length -= amt
+            if length <= 0:
+                return
+            off = 0
+
+    def read(self, off: int, length: int) -> bytes:
+        return b"".join(self.read_range(off, length))
+
+    def stream(self) -> Iterator[bytes]:
+        """Yield the contents of the stash, in the same format as reading it"""
+        if self.flags & CRASHSTASH_F_PERCPU:
+            yield _merge_percpu(
+                self.prog, self.read(0, self.capacity), self.nr_cpus, self.cpu_size
+            )
+        elif self.flags & CRASHSTASH_F_RING:
+            # The ring has only wrapped around if every page is allocated
+            start = self.ring_tail % self.capacity
+            first = min(self.size, self.storage - start)
+            yield from self.read_range(start, first)
+            yield from self.read_range(0, self.size - first)
+        elif self.flags & CRASHSTASH_F_LZ4:
+            yield from _decompress_lz4(self)
+            yield self.prog.read(self.stage, self.stage_len)
+        else:
+            # Pages are allocated a chunk at a time (or all up front, for a
+            # preallocated stash), so there may be more than "size" needs.
+            yield from self.read_range(0, self.size)
+
+
+def _read_crashstash(prog: Program, addrs: Dict[str, int]) -> bytes:
+    return b"".join(_Stash(prog, addrs).stream())
+
+
+def get_crashstashes(prog: Program) -> Dict[str, bytes]:
+    """Return the contents of every stash, by name"""
+    return {
+        name: _read_crashstash(prog, addrs)
+        for name, addrs in _find_crashstashes(prog).items()
+    }
+
+
+def get_crashstash(prog: Program, name: str = "default") -> bytes:
+    stashes = _find_crashstashes(prog)
+    if name not in stashes:
+        raise Exception(f"Could not find a crashstash named {name}")
+    return _read_crashstash(prog, stashes[name])
+
+
+def extract_crashstash(
+    prog: Program, out: BinaryIO, name: str = "default"
+) -> int:
+    """
+    Write the contents of a stash to a file as they are read, rather than
+    building them in memory. Returns the number of bytes written.
+    """
+    stashes = _find_crashstashes(prog)
+    if name not in stashes:
+        raise Exception(f"Could not find a crashstash named {name}")
+    total = 0
+    for data in _Stash(prog, stashes[name]).stream():
+        out.write(data)
+        total += len(data)
+    return total
+
+
+def crashstash_records(prog: Program, data: bytes) -> List[bytes]:
+    """
+    Split the contents of a ring mode crashstash into its records. Each record
+    is a u32 length, followed by the data padded to a multiple of 4 bytes.
+    """
+    byteorder = _byteorder(prog)
+    records = []
+    off = 0
+    while off + 4 <= len(data):
+        length = int.from_bytes(data[off:off + 4], byteorder)
+        records.append(data[off + 4:off + 4 + length])
+        off += 4 + (length + 3) // 4 * 4
+    return records
+
+
+def crashstash_percpu_records(
+    prog: Program, data: bytes
+) -> List[Tuple[int, int, bytes]]:
+    """
+    Split the contents of a percpu mode crashstash into (timestamp, cpu, data)
+    tuples. Each record is a u64 timestamp, u32 length and u32 CPU, followed by
+    the data padded to a multiple of 8 bytes.
+    """
+    byteorder = _byteorder(prog)
+    records = []
+    off = 0
+    while off + 16 <= len(data):
+        ts = int.from_bytes(data[off:off + 8], byteorder)
+        length = int.from_bytes(data[off + 8:off + 12], byteorder)
+        cpu = int.from_bytes(data[off + 12:off + 16], byteorder)
+        records.append((ts, cpu, data[off + 16:off + 16 + length]))
+        off += 16 + (length + 7) // 8 * 8
+    return records
+
+
+def libcrashstash_records(
+    prog: Program, data: bytes
+) -> List[Tuple[int, int, int, bytes]]:
+    """
+    Split records written with libcrashstash into (timestamp, seq, type, data)
+    tuples, sorted by sequence number. Each record is a u64 timestamp, u64
+    sequence number, u32 type and u32 length, followed by the data padded to a
+    multiple of 8 bytes. Each write() holds whole records, so for a ring mode
+    stash, pass the records from crashstash_records() joined together, and for
+    a percpu stash, the data of each record from crashstash_percpu_records().
+    """
+    fmt = ("<" if _byteorder(prog) == "little" else ">") + "QQII"
+    records = []
+    off = 0
+    while off + 24 <= len(data):
+        ts, seq, typ, length = struct.unpack_from(fmt, data, off)
+        if off + 24 + length > len(data):
             break
-    else:
-        raise Exception("Could not find a crashstash log record")
-
-    head = Object(prog, "struct list_head *", value=int(match.group("STASH"), 16))
-    size = Object(prog, "u64", address=int(match.group("SIZE"), 16)).value_()
-    page_count = Object(prog, "u64", address=int(match.group("PAGES"), 16)).value_()
-
-    pages = list(list_for_each_entry("struct page", head, "lru"))
-    PAGE_SIZE = prog["PAGE_SIZE"].value_()
-
-    if len(pages) != page_count or page_count != math.ceil(size / PAGE_SIZE):
-        raise Exception("Inconsistent metadata for crashstash size")
-
-    data = b""
-    for page in pages:
-        chunksz = min(PAGE_SIZE, size)
-        chunkdat = prog.read(page_to_virt(page), chunksz)
-        data += chunkdat
-        size -= chunksz
-    return data
+        records.append((ts, seq, typ, data[off + 24:off + 24 + length]))
+        off += 24 + (length + 7) // 8 * 8
+    records.sort(key=lambda rec: rec[1])
+    return records
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(
+        description="Extract a crashstash from a vmcore to a file"
+    )
+    parser.add_argument("vmcore", help="vmcore to read")
+    parser.add_argument(
+        "-n", "--name", default="default", help="name of the stash (default: default)"
+    )
+    parser.add_argument("-o", "--output", required=True, help="file to write")
+    parser.add_argument(
+        "-d", "--debuginfo", action="append", default=[],
+        help="additional debuginfo file (may be given multiple times)",
+    )
+    args = parser.parse_args()
+
+    prog = Program()
+    prog.set_core_dump(args.vmcore)
+    prog.load_debug_info(args.debuginfo, default=True)
+    start = time.monotonic()
+    with open(args.output, "wb") as f:
+        total = extract_crashstash(prog, f, args.name)
+    elapsed = time.monotonic() - start
+    print(f"wrote {total} bytes in {elapsed:.2f}s")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,858 @@
+/*
+ * Benchmarks for the crashstash module.
+ *
+ * gcc -O2 -pthread -o crashstash_bench crashstash_bench.c libcrashstash.c
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "crashstash.h"
+#include "libcrashstash.h"
+
+#define nelem(arr) (sizeof(arr) / sizeof(arr[0]))
+
+#define KB (1UL << 10)
+#define MB (1UL << 20)
+
+#define CONTROL "/proc/crashstash/control"
+
+/* Chunk sizes for the write and read sweeps */
+static const size_t SWEEP[] = {
+	16, 64, 256, 1 * KB, 4 * KB, 16 * KB, 64 * KB, 256 * KB, 1 * MB,
+};
+
+struct bench {
+	const char *path;
+	size_t size;
+	int repeat;
+	char *buf;
+};
+
+static void fail(const char *msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int open_stash(struct bench *b, int flags)
+{
+	int fd = open(b->path, flags);
+
+	if (fd < 0)
+		fail(b->path);
+	return fd;
+}
+
+/* Send a command to the control file, e.g. "create foo percpu" */
+static int control(const char *fmt, ...)
+{
+	char cmd[128];
+	va_list args;
+	int fd, rv = 0;
+
+	va_start(args, fmt);
+	vsnprintf(cmd, sizeof(cmd), fmt, args);
+	va_end(args);
+	fd = open(CONTROL, O_WRONLY);
+	if (fd < 0)
+		fail(CONTROL);
+	if (write(fd, cmd, strlen(cmd)) < 0)
+		rv = -errno;
+	close(fd);
+	return rv;
+}
+
+/* Replace the stash contents with b->size bytes of data */
+static void fill_stash(struct bench *b)
+{
+	size_t done = 0;
+	ssize_t rv;
+	int fd = open_stash(b, O_WRONLY);
+
+	while (done < b->size) {
+		size_t amt = b->size - done;
+
+		if (amt > MB)
+			amt = MB;
+		rv = write(fd, b->buf, amt);
+		if (rv < 0)
+			fail("write");
+		done += rv;
+	}
+	close(fd);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts the samples, and returns the given percentile */
+static uint64_t percentile(uint64_t *samples, size_t n, double pct)
+{
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	return samples[(size_t)((n - 1) * pct / 100)];
+}
+
+/*
+ * Write b->size bytes to the stash, from a fresh open, with each chunk size
+ * from 16 bytes to 1 MiB, timing every write() individually. The throughput is
+ * the best of the runs, and the latencies are from all of them together.
+ */
+static void bench_write(struct bench *b)
+{
+	int i, r;
+
+	printf("%10s %12s %10s %10s %10s %10s\n", "chunk", "MiB/s",
+	       "p50 us", "p99 us", "p99.9 us", "max us");
+	for (i = 0; i < nelem(SWEEP); i++) {
+		size_t per_run = (b->size + SWEEP[i] - 1) / SWEEP[i];
+		uint64_t *lat = malloc(per_run * b->repeat * sizeof(*lat));
+		uint64_t best = UINT64_MAX;
+		size_t n = 0, written = 0;
+
+		if (!lat)
+			fail("malloc");
+		for (r = 0; r < b->repeat; r++) {
+			uint64_t start = now_ns(), t, elapsed;
+			int fd = open_stash(b, O_WRONLY);
+
+			for (written = 0; written < b->size;) {
+				ssize_t rv;
+
+				t = now_ns();
+				rv = write(fd, b->buf, SWEEP[i]);
+				lat[n++] = now_ns() - t;
+				if (rv < 0 && errno == ENOSPC)
+					break;
+				if (rv < 0)
+					fail("write");
+				written += rv;
+			}
+			elapsed = now_ns() - start;
+			close(fd);
+			if (elapsed < best)
+				best = elapsed;
+		}
+		printf("%10zu %12.1f %10.2f %10.2f %10.2f %10.2f\n", SWEEP[i],
+		       ((double)written / MB) / (best / 1e9),
+		       percentile(lat, n, 50) / 1e3, percentile(lat, n, 99) / 1e3,
+		       percentile(lat, n, 99.9) / 1e3, lat[n - 1] / 1e3);
+		free(lat);
+	}
+}
+
+/*
+ * Fill temporary ordinary and preallocated stashes of b->size bytes, with 1
+ * MiB writes until ENOSPC. The ordinary stash allocates its pages as it goes,
+ * and the preallocated one allocates them all when it's created.
+ */
+static void bench_fill(struct bench *b)
+{
+	static const char *MODES[] = {"ordinary", "prealloc"};
+	int i, r, rv;
+
+	printf("%10s %12s %12s %12s\n", "mode", "create ms", "fill ms", "fill MiB/s");
+	for (i = 0; i < nelem(MODES); i++) {
+		uint64_t best_create = UINT64_MAX, best_fill = UINT64_MAX;
+		size_t total = 0;
+
+		for (r = 0; r < b->repeat; r++) {
+			uint64_t start, created, filled;
+			int fd;
+
+			control("remove bench-fill");
+			start = now_ns();
+			rv = control("create bench-fill %s size=%zu",
+				     i ? "prealloc" : "", b->size);
+			if (rv) {
+				errno = -rv;
+				fail("create stash");
+			}
+			created = now_ns();
+			fd = open("/proc/crashstash/bench-fill", O_WRONLY);
+			if (fd < 0)
+				fail("/proc/crashstash/bench-fill");
+			total = 0;
+			while ((rv = write(fd, b->buf, MB)) > 0)
+				total += rv;
+			if (rv < 0 && errno != ENOSPC)
+				fail("write");
+			close(fd);
+			filled = now_ns();
+			if (created - start < best_create)
+				best_create = created - start;
+			if (filled - created < best_fill)
+				best_fill = filled - created;
+		}
+		control("remove bench-fill");
+		printf("%10s %12.2f %12.2f %12.1f\n", MODES[i], best_create / 1e6,
+		       best_fill / 1e6, ((double)total / MB) / (best_fill / 1e9));
+	}
+}
+
+/*
+ * Read the entire stash at each chunk size from 16 bytes to 1 MiB. With the
+ * old list-walking read, small chunks are dramatically slower, since each
+ * read() walks the list from the head to find its starting page.
+ */
+static void bench_read(struct bench *b)
+{
+	int i, r;
+
+	fill_stash(b);
+	printf("%10s %10s %12s %12s\n", "chunk", "size", "MiB/s", "us/read");
+	for (i = 0; i < nelem(SWEEP); i++) {
+		uint64_t best = UINT64_MAX;
+		unsigned long calls = 0;
+
+		for (r = 0; r < b->repeat; r++) {
+			uint64_t start, elapsed;
+			size_t total = 0;
+			ssize_t rv;
+			int fd = open_stash(b, O_RDONLY);
+
+			calls = 0;
+			start = now_ns();
+			while ((rv = read(fd, b->buf, SWEEP[i])) > 0) {
+				total += rv;
+				calls++;
+			}
+			elapsed = now_ns() - start;
+			if (rv < 0)
+				fail("read");
+			close(fd);
+			if (total != b->size) {
+				fprintf(stderr, "error: read %zu bytes, expected %zu\n", total, b->size);
+				exit(EXIT_FAILURE);
+			}
+			if (elapsed < best)
+				best = elapsed;
+		}
+		printf("%10zu %10zu %12.1f %12.2f\n", SWEEP[i], b->size,
+		       ((double)b->size / MB) / (best / 1e9),
+		       (double)best / 1000 / calls);
+	}
+}
+
+#define REC_SIZE 64
+
+struct writer {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	const char *path;
+	int fd;          /* shared fd, or -1 to open our own */
+	struct libcrashstash *lib;  /* or log through libcrashstash */
+	int cpu;
+	unsigned long count;
+	unsigned long written;
+};
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+	char rec[REC_SIZE];
+	cpu_set_t set;
+	int fd = w->fd;
+	unsigned long i;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+	if (!w->lib && fd < 0 && (fd = open(w->path, O_WRONLY)) < 0)
+		fail(w->path);
+	memset(rec, 'A', sizeof(rec));
+	pthread_barrier_wait(w->barrier);
+	for (i = 0; i < w->count; i++) {
+		if (w->lib) {
+			int rv = libcrashstash_log(w->lib, 0, rec, sizeof(rec));
+
+			if (rv < 0) {
+				errno = -rv;
+				fail("libcrashstash_log");
+			}
+		} else if (write(fd, rec, sizeof(rec)) < 0) {
+			/* a percpu buffer filling up just ends the run */
+			if (errno == ENOSPC)
+				break;
+			fail("write");
+		}
+		w->written++;
+	}
+	if (!w->lib && w->fd < 0)
+		close(fd);
+	return NULL;
+}
+
+/*
+ * Returns records per second for "nthreads" writers on stash "bench-MODE". They
+ * share one fd if "shared", or one libcrashstash if "lib" (in which case the
+ * time includes the final flush).
+ */
+static double run_writers(struct bench *b, const char *mode, bool shared, bool lib,
+			  int *cpus, int nthreads)
+{
+	struct writer *w = calloc(nthreads, sizeof(*w));
+	struct libcrashstash *cs = NULL;
+	pthread_barrier_t barrier;
+	unsigned long total = 0;
+	uint64_t start, elapsed;
+	char path[64];
+	int i, fd = -1;
+
+	snprintf(path, sizeof(path), "/proc/crashstash/bench-%s", mode);
+	if (shared && (fd = open(path, O_WRONLY)) < 0)
+		fail(path);
+	if (lib && !(cs = libcrashstash_open(path + strlen("/proc/crashstash/"), NULL)))
+		fail("libcrashstash_open");
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		w[i].barrier = &barrier;
+		w[i].path = path;
+		w[i].fd = fd;
+		w[i].lib = cs;
+		w[i].cpu = cpus[i];
+		/* roughly what fits in one CPU's share of a percpu stash */
+		w[i].count = b->size / sysconf(_SC_NPROCESSORS_CONF) / (REC_SIZE + 16);
+		if (pthread_create(&w[i].thread, NULL, writer_thread, &w[i]))
+			fail("pthread_create");
+	}
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].thread, NULL);
+		total += w[i].written;
+	}
+	if (cs && libcrashstash_close(cs))
+		fail("libcrashstash_close");
+	elapsed = now_ns() - start;
+	pthread_barrier_destroy(&barrier);
+	if (fd >= 0)
+		close(fd);
+	free(w);
+	return total / (elapsed / 1e9);
+}
+
+/*
+ * Compare concurrent writers of small records. The mutex case is a ring mode
+ * stash, whose single file descriptor is shared by all threads. The percpu case
+ * has each thread open the stash itself, and write without any locking.
+ */
+static void bench_threads(struct bench *b)
+{
+	static const char *MODES[] = {"ring", "percpu"};
+	int cpus[CPU_SETSIZE], ncpus = 0, nthreads, i, r, rv;
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		fail("sched_getaffinity");
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &set))
+			cpus[ncpus++] = i;
+
+	printf("%8s %14s %14s\n", "threads", "mutex Mrec/s", "percpu Mrec/s");
+	for (nthreads = 1; ; nthreads = nthreads * 2 < ncpus ? nthreads * 2 : ncpus) {
+		double result[2] = {0, 0};
+
+		for (i = 0; i < nelem(MODES); i++) {
+			for (r = 0; r < b->repeat; r++) {
+				double rate;
+
+				control("remove bench-%s", MODES[i]);
+				rv = control("create bench-%s %s size=%zu", MODES[i], MODES[i], b->size);
+				if (rv) {
+					errno = -rv;
+					fail("create stash");
+				}
+				rate = run_writers(b, MODES[i], i == 0, false, cpus, nthreads);
+				if (rate > result[i])
+					result[i] = rate;
+			}
+			control("remove bench-%s", MODES[i]);
+		}
+		printf("%8d %14.2f %14.2f\n", nthreads, result[0] / 1e6, result[1] / 1e6);
+		if (nthreads == ncpus)
+			break;
+	}
+}
+
+/*
+ * Compare threads writing 64 byte records to a ring mode stash, each with its
+ * own write(), against logging them through libcrashstash, which batches them
+ * into large writes.
+ */
+static void bench_client(struct bench *b)
+{
+	int cpus[CPU_SETSIZE], ncpus = 0, nthreads, i, r, rv;
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		fail("sched_getaffinity");
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &set))
+			cpus[ncpus++] = i;
+
+	control("remove bench-ring");
+	rv = control("create bench-ring ring size=%zu", b->size);
+	if (rv) {
+		errno = -rv;
+		fail("create stash");
+	}
+	printf("%8s %14s %14s\n", "threads", "write Mrec/s", "lib Mrec/s");
+	for (nthreads = 1; ; nthreads = nthreads * 2 < ncpus ? nthreads * 2 : ncpus) {
+		double result[2] = {0, 0};
+
+		for (i = 0; i < 2; i++) {
+			for (r = 0; r < b->repeat; r++) {
+				double rate = run_writers(b, "ring", i == 0, i == 1, cpus, nthreads);
+
+				if (rate > result[i])
+					result[i] = rate;
+			}
+		}
+		printf("%8d %14.2f %14.2f\n", nthreads, result[0] / 1e6, result[1] / 1e6);
+		if (nthreads == ncpus)
+			break;
+	}
+	control("remove bench-ring");
+}
+
+#define BUSY_OPENS 1000
+
+struct busy_result {
+	unsigned long opens;
+	unsigned long retries;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+};
+
+/*
+ * One process: open the stash for writing BUSY_OPENS times, retrying while it
+ * fails with EBUSY, and write 4K each time.
+ */
+static void busy_child(struct bench *b, pthread_barrier_t *barrier, struct busy_result *res)
+{
+	int i, fd;
+
+	pthread_barrier_wait(barrier);
+	for (i = 0; i < BUSY_OPENS; i++) {
+		uint64_t start = now_ns(), wait;
+
+		while ((fd = open(b->path, O_WRONLY)) < 0) {
+			if (errno != EBUSY)
+				fail(b->path);
+			res->retries++;
+		}
+		wait = now_ns() - start;
+		res->wait_ns += wait;
+		if (wait > res->max_wait_ns)
+			res->max_wait_ns = wait;
+		if (write(fd, b->buf, 4 * KB) < 0)
+			fail("write");
+		close(fd);
+		res->opens++;
+	}
+}
+
+/*
+ * Processes contending for the stash, which only one may have open at a time.
+ * This is the worst case for independent services sharing one stash.
+ */
+static void bench_busy(struct bench *b)
+{
+	int ncpus = sysconf(_SC_NPROCESSORS_ONLN), nprocs, i;
+	pthread_barrierattr_t attr;
+	pthread_barrier_t *barrier;
+	struct busy_result *res;
+
+	barrier = mmap(NULL, sizeof(*barrier) + ncpus * sizeof(*res),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (barrier == MAP_FAILED)
+		fail("mmap");
+	res = (struct busy_result *)(barrier + 1);
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+
+	printf("%8s %12s %14s %12s %12s\n", "procs", "opens/s", "retries/open",
+	       "avg wait us", "max wait us");
+	for (nprocs = 1; ; nprocs = nprocs * 2 < ncpus ? nprocs * 2 : ncpus) {
+		struct busy_result sum = {0};
+		uint64_t start, elapsed;
+
+		memset(res, 0, ncpus * sizeof(*res));
+		pthread_barrier_init(barrier, &attr, nprocs + 1);
+		for (i = 0; i < nprocs; i++) {
+			pid_t pid = fork();
+
+			if (pid < 0)
+				fail("fork");
+			if (pid == 0) {
+				busy_child(b, barrier, &res[i]);
+				_exit(0);
+			}
+		}
+		pthread_barrier_wait(barrier);
+		start = now_ns();
+		for (i = 0; i < nprocs; i++) {
+			int status;
+
+			if (wait(&status) < 0)
+				fail("wait");
+			if (!WIFEXITED(status) || WEXITSTATUS(status))
+				exit(EXIT_FAILURE);
+		}
+		elapsed = now_ns() - start;
+		pthread_barrier_destroy(barrier);
+		for (i = 0; i < nprocs; i++) {
+			sum.opens += res[i].opens;
+			sum.retries += res[i].retries;
+			sum.wait_ns += res[i].wait_ns;
+			if (res[i].max_wait_ns > sum.max_wait_ns)
+				sum.max_wait_ns = res[i].max_wait_ns;
+		}
+		printf("%8d %12.0f %14.1f %12.2f %12.2f\n", nprocs,
+		       sum.opens / (elapsed / 1e9), (double)sum.retries / sum.opens,
+		       (double)sum.wait_ns / sum.opens / 1e3, sum.max_wait_ns / 1e3);
+		if (nprocs == ncpus)
+			break;
+	}
+	pthread_barrierattr_destroy(&attr);
+	munmap(barrier, sizeof(*barrier) + ncpus * sizeof(*res));
+}
+
+/* A memfd of b->size bytes, as a stand-in for a log file in the page cache */
+static int make_payload(struct bench *b)
+{
+	size_t done = 0;
+	int fd = memfd_create("crashstash_bench", 0);
+
+	if (fd < 0)
+		fail("memfd_create");
+	while (done < b->size) {
+		size_t amt = b->size - done < MB ? b->size - done : MB;
+		ssize_t rv = write(fd, b->buf, amt);
+
+		if (rv < 0)
+			fail("write memfd");
+		done += rv;
+	}
+	return fd;
+}
+
+/* Copy from "in" to "out" through a userspace buffer, the traditional way */
+static size_t copy_loop(struct bench *b, int in, int out)
+{
+	size_t total = 0;
+	ssize_t rv, wr;
+
+	while ((rv = read(in, b->buf, 64 * KB)) > 0) {
+		wr = write(out, b->buf, rv);
+		if (wr != rv)
+			fail("write");
+		total += wr;
+	}
+	if (rv < 0)
+		fail("read");
+	return total;
+}
+
+static size_t append_ioctl(struct bench *b, int in, int out)
+{
+	long rv = ioctl(out, CRASHSTASH_IOC_APPEND_FD, in);
+
+	if (rv < 0)
+		fail("CRASHSTASH_IOC_APPEND_FD");
+	return rv;
+}
+
+static size_t sendfile_loop(struct bench *b, int in, int out)
+{
+	size_t total = 0;
+	ssize_t rv;
+
+	while ((rv = sendfile(out, in, NULL, b->size - total)) > 0)
+		total += rv;
+	if (rv < 0)
+		fail("sendfile");
+	return total;
+}
+
+/*
+ * Compare loading a file into the stash, and dumping it back out to another
+ * file, through a userspace buffer vs. in the kernel.
+ */
+static void bench_splice(struct bench *b)
+{
+	static const struct {
+		const char *name;
+		bool in;
+		size_t (*fn)(struct bench *, int, int);
+	} METHODS[] = {
+		{"read+write in", true, copy_loop},
+		{"ioctl in", true, append_ioctl},
+		{"read+write out", false, copy_loop},
+		{"sendfile out", false, sendfile_loop},
+	};
+	int payload = make_payload(b);
+	int i, r;
+
+	printf("%16s %10s %12s\n", "method", "size", "MiB/s");
+	for (i = 0; i < nelem(METHODS); i++) {
+		uint64_t best = UINT64_MAX;
+
+		for (r = 0; r < b->repeat; r++) {
+			uint64_t start, elapsed;
+			int stash, other;
+			size_t total;
+
+			if (METHODS[i].in) {
+				stash = open_stash(b, O_WRONLY);
+				other = payload;
+				lseek(other, 0, SEEK_SET);
+			} else {
+				fill_stash(b);
+				stash = open_stash(b, O_RDONLY);
+				other = memfd_create("crashstash_bench_out", 0);
+				if (other < 0)
+					fail("memfd_create");
+			}
+			start = now_ns();
+			if (METHODS[i].in)
+				total = METHODS[i].fn(b, other, stash);
+			else
+				total = METHODS[i].fn(b, stash, other);
+			elapsed = now_ns() - start;
+			close(stash);
+			if (!METHODS[i].in)
+				close(other);
+			if (total != b->size) {
+				fprintf(stderr, "error: copied %zu bytes, expected %zu\n", total, b->size);
+				exit(EXIT_FAILURE);
+			}
+			if (elapsed < best)
+				best = elapsed;
+		}
+		printf("%16s %10zu %12.1f\n", METHODS[i].name, b->size,
+		       ((double)b->size / MB) / (best / 1e9));
+	}
+	close(payload);
+}
+
+/* Fill "buf" with log lines, like the breadcrumbs an application would stash */
+static void make_log_text(char *buf, size_t len)
+{
+	static const char *STATUS[] = {"ok", "ok", "ok", "retry", "timeout"};
+	unsigned long seq = 0, x = 12345;
+	size_t off = 0;
+
+	while (off < len) {
+		char line[160];
+		int n;
+
+		x = x * 6364136223846793005UL + 1442695040888963407UL;
+		n = snprintf(line, sizeof(line),
+			     "2026-01-01T00:%02lu:%02lu.%06lu worker-%lu: request %lu "
+			     "GET /api/v1/items/%lu took %lu us status=%s\n",
+			     seq / 60000 % 60, seq / 1000 % 60, x % 1000000, (x >> 20) % 16,
+			     seq, (x >> 24) % 100000, (x >> 40) % 5000, STATUS[(x >> 50) % 5]);
+		if (n > len - off)
+			n = len - off;
+		memcpy(buf + off, line, n);
+		off += n;
+		seq++;
+	}
+}
+
+/*
+ * Write log text into an ordinary and an lz4 stash of the same size until they
+ * are full, and compare how much each one holds, and how fast.
+ */
+static void bench_compress(struct bench *b)
+{
+	static const char *MODES[] = {"plain", "lz4"};
+	char *text = malloc(MB);
+	int i, r, rv;
+
+	make_log_text(text, MB);
+	printf("%8s %12s %12s %8s %12s\n", "mode", "input MiB", "stash MiB", "ratio", "MiB/s");
+	for (i = 0; i < nelem(MODES); i++) {
+		double best = 0;
+		size_t total = 0;
+		struct stat st;
+
+		for (r = 0; r < b->repeat; r++) {
+			uint64_t start, elapsed;
+			char path[64];
+			ssize_t wr;
+			int fd;
+
+			control("remove bench-%s", MODES[i]);
+			rv = control("create bench-%s %s size=%zu", MODES[i],
+				     i ? MODES[i] : "", b->size);
+			if (rv) {
+				errno = -rv;
+				fail("create stash");
+			}
+			snprintf(path, sizeof(path), "/proc/crashstash/bench-%s", MODES[i]);
+			fd = open(path, O_WRONLY);
+			if (fd < 0)
+				fail(path);
+			total = 0;
+			start = now_ns();
+			/* in 4K writes, until full (or a sanity limit) */
+			while (total < 64 * b->size) {
+				wr = write(fd, text + total % MB, 4 * KB);
+				if (wr < 0 && errno == ENOSPC)
+					break;
+				if (wr < 0)
+					fail("write");
+				total += wr;
+			}
+			elapsed = now_ns() - start;
+			close(fd);
+			if (stat(path, &st))
+				fail(path);
+			if (total / (elapsed / 1e9) > best)
+				best = total / (elapsed / 1e9);
+		}
+		control("remove bench-%s", MODES[i]);
+		printf("%8s %12.1f %12.1f %8.2f %12.1f\n", MODES[i], (double)total / MB,
+		       (double)st.st_size / MB, (double)total / st.st_size, best / MB);
+	}
+	free(text);
+}
+
+struct { const char *name; void (*fn)(struct bench *); } TESTS[] = {
+	{ "write", bench_write },
+	{ "fill", bench_fill },
+	{ "read", bench_read },
+	{ "busy", bench_busy },
+	{ "threads", bench_threads },
+	{ "splice", bench_splice },
+	{ "compress", bench_compress },
+	{ "client", bench_client },
+};
+
+void help(void)
+{
+	puts(
+		"usage: crashstash_bench [-f FILE] [-s SIZE] [-r REPEAT] TEST...\n"
+		"\n"
+		"Run benchmarks against the crashstash module. Note that every test\n"
+		"replaces the current stash contents.\n"
+		"\n"
+		"Tests:\n"
+		"  write                write the stash size with chunks of 16 bytes to 1M,\n"
+		"                       reporting throughput and write() latency\n"
+		"  fill                 fill temporary ordinary and prealloc stashes until\n"
+		"                       ENOSPC, reporting create and fill time\n"
+		"  read                 fill the stash, then read it back with chunks of 16\n"
+		"                       bytes to 1M\n"
+		"  busy                 1, 2, 4, ... processes repeatedly opening the stash\n"
+		"                       for writing, retrying on EBUSY\n"
+		"  threads              compare writers sharing a ring mode stash (serialized\n"
+		"                       by its mutex) with a percpu stash, for 1 thread up\n"
+		"                       to one per CPU, using temporary stashes\n"
+		"  splice               copy a file into the stash and back out, with\n"
+		"                       read()/write() vs. the append ioctl and sendfile()\n"
+		"  compress             fill an ordinary and an lz4 stash with log text, and\n"
+		"                       report how much each holds, and write throughput\n"
+		"  client               compare threads writing records to a ring mode stash\n"
+		"                       directly, with logging them through libcrashstash\n"
+		"\n"
+		"Options:\n"
+		"  -f, --file FILE      crashstash file (default /proc/crashstash/default)\n"
+		"  -s, --size SIZE      stash size to use, in KiB (default 10240)\n"
+		"  -r, --repeat N       report the best of N runs (default 5)\n"
+		"  -h, --help           print this message and exit\n"
+	);
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = {
+		.path = "/proc/crashstash/default",
+		.size = 10 * MB,
+		.repeat = 5,
+	};
+	int opt, i, j;
+
+	const char *shopt = "f:s:r:h";
+	static struct option lopt[] = {
+		{"file",   required_argument, NULL, 'f'},
+		{"size",   required_argument, NULL, 's'},
+		{"repeat", required_argument, NULL, 'r'},
+		{"help",   no_argument,       NULL, 'h'},
+		{0},
+	};
+	while ((opt = getopt_long(argc, argv, shopt, lopt, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			help();
+			break;
+		case 'f':
+			b.path = optarg;
+			break;
+		case 's':
+			b.size = strtoul(optarg, NULL, 10) * KB;
+			break;
+		case 'r':
+			b.repeat = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Invalid argument, try -h for help\n");
+			return 1;
+		}
+	}
+	argv += optind;
+	argc -= optind;
+
+	if (!argc || !b.size || b.repeat <= 0) {
+		fprintf(stderr, "error: need at least one test, and a nonzero size and repeat\n");
+		return 1;
+	}
+	b.buf = malloc(MB);
+	memset(b.buf, 'A', MB);
+	for (i = 0; i < argc; i++) {
+		for (j = 0; j < nelem(TESTS); j++) {
+			if (strcmp(TESTS[j].name, argv[i]) == 0)
+				break;
+		}
+		if (j == nelem(TESTS)) {
+			fprintf(stderr, "error: unknown test \"%s\"\n", argv[i]);
+			return 1;
+		}
+		printf("== %s\n", TESTS[j].name);
+		TESTS[j].fn(&b);
+	}
+	free(b.buf);
+	return 0;
+}
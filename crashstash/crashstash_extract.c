@@ -0,0 +1,594 @@
+/**
+ * Extract a stash from a vmcore (ELF or kdump) without drgn or debuginfo.
+ *
+ * The stash's descriptor is found through the kernel log (which is located
+ * using vmcoreinfo), or failing that, by scanning memory for its magic. The
+ * chunk list is walked using the struct page offsets from vmcoreinfo, and the
+ * contents are streamed out with large physical reads.
+ *
+ * gcc -O2 -Wall -o crashstash_extract crashstash_extract.c -lkdumpfile
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libkdumpfile/kdumpfile.h>
+
+#include "crashstash.h"
+
+#define MB (1UL << 20)
+#define MAX_READ (16 * MB)
+#define MAX_EXTENTS (1 << 20)
+
+/* The first fields of struct crashstash_meta, from crashstash.c */
+struct crashstash_meta {
+	uint64_t flags;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t capacity;
+	uint64_t nr_cpus;
+	uint64_t cpu_size;
+	uint64_t stage;
+	uint64_t stage_len;
+};
+
+struct extent {
+	uint64_t phys;
+	uint64_t len;
+};
+
+struct extractor {
+	kdump_ctx_t *ctx;
+	char *vmcoreinfo;
+	kdump_num_t max_pfn;
+	kdump_num_t page_size;
+	kdump_num_t page_shift;
+	kdump_bmp_t *pagemap;
+	uint64_t sizeof_page;
+	uint64_t offset_lru;
+	uint64_t offset_private;
+	bool verbose;
+};
+
+void fail(const char *fmt, ...)
+{
+	va_list vl;
+	va_start(vl, fmt);
+	vfprintf(stderr, fmt, vl);
+	va_end(vl);
+	exit(EXIT_FAILURE);
+}
+
+void perror_fail(const char *msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* CRC32 as computed by zlib (and the kernel's crc32_le(~0, ...) ^ ~0) */
+uint32_t crc32(const void *data, size_t len)
+{
+	static uint32_t table[256];
+	const uint8_t *p = data;
+	uint32_t crc = ~0U;
+
+	if (!table[1]) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/*
+ * Look up a vmcoreinfo line such as "OFFSET(page.lru)=24". Returns false if it
+ * is not present. SYMBOL() values are hex, and everything else is decimal.
+ */
+bool vmcoreinfo_number(struct extractor *ex, const char *key, uint64_t *val)
+{
+	size_t keylen = strlen(key);
+	char *line = ex->vmcoreinfo;
+
+	while (line && *line) {
+		if (strncmp(line, key, keylen) == 0 && line[keylen] == '=') {
+			int base = strncmp(key, "SYMBOL(", 7) == 0 ? 16 : 10;
+			*val = strtoull(line + keylen + 1, NULL, base);
+			return true;
+		}
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+	return false;
+}
+
+uint64_t vmcoreinfo_require(struct extractor *ex, const char *key)
+{
+	uint64_t val;
+	if (!vmcoreinfo_number(ex, key, &val))
+		fail("vmcoreinfo has no %s\n", key);
+	return val;
+}
+
+void init_extractor(struct extractor *ex, int fd)
+{
+	kdump_status ks;
+	kdump_attr_t bitmap_attr;
+
+	ex->ctx = kdump_new();
+	if (!ex->ctx)
+		fail("kdump_new() failed\n");
+
+	ks = kdump_set_number_attr(ex->ctx, KDUMP_ATTR_FILE_FD, fd);
+	if (ks != KDUMP_OK)
+		fail("kdump_set_number_attr(KDUMP_ATTR_FILE_FD): %s\n",
+		     kdump_get_err(ex->ctx));
+
+	ks = kdump_set_string_attr(ex->ctx, KDUMP_ATTR_OSTYPE, "linux");
+	if (ks != KDUMP_OK)
+		fail("kdump_set_string_attr(KDUMP_ATTR_OSTYPE): %s\n",
+		     kdump_get_err(ex->ctx));
+
+	ks = kdump_vmcoreinfo_raw(ex->ctx, &ex->vmcoreinfo);
+	if (ks != KDUMP_OK)
+		fail("kdump_vmcoreinfo_raw: %s\n", kdump_get_err(ex->ctx));
+
+	ks = kdump_get_number_attr(ex->ctx, "max_pfn", &ex->max_pfn);
+	if (ks != KDUMP_OK)
+		fail("kdump_get_number_attr(max_pfn): %s\n",
+		     kdump_get_err(ex->ctx));
+
+	ks = kdump_get_number_attr(ex->ctx, KDUMP_ATTR_PAGE_SIZE, &ex->page_size);
+	if (ks != KDUMP_OK)
+		fail("kdump_get_number_attr(KDUMP_ATTR_PAGE_SIZE): %s\n",
+		     kdump_get_err(ex->ctx));
+
+	ks = kdump_get_number_attr(ex->ctx, KDUMP_ATTR_PAGE_SHIFT, &ex->page_shift);
+	if (ks != KDUMP_OK)
+		fail("kdump_get_number_attr(KDUMP_ATTR_PAGE_SHIFT): %s\n",
+		     kdump_get_err(ex->ctx));
+
+	ks = kdump_get_attr(ex->ctx, KDUMP_ATTR_FILE_PAGEMAP, &bitmap_attr);
+	if (ks != KDUMP_OK)
+		fail("kdump_get_attr(KDUMP_ATTR_FILE_PAGEMAP): %s\n",
+		     kdump_get_err(ex->ctx));
+	assert(bitmap_attr.type == KDUMP_BITMAP);
+	ex->pagemap = bitmap_attr.val.bitmap;
+
+	ex->sizeof_page = vmcoreinfo_require(ex, "SIZE(page)");
+	ex->offset_lru = vmcoreinfo_require(ex, "OFFSET(page.lru)");
+	ex->offset_private = vmcoreinfo_require(ex, "OFFSET(page.private)");
+}
+
+/* Read exactly len bytes, or return false */
+bool try_read(struct extractor *ex, kdump_addrspace_t as, uint64_t addr,
+	      void *buf, size_t len)
+{
+	size_t got = len;
+	kdump_status ks = kdump_read(ex->ctx, as, addr, buf, &got);
+	return ks == KDUMP_OK && got == len;
+}
+
+void read_or_fail(struct extractor *ex, kdump_addrspace_t as, uint64_t addr,
+		  void *buf, size_t len)
+{
+	if (!try_read(ex, as, addr, buf, len))
+		fail("error reading %zu bytes at 0x%lx: %s\n", len, addr,
+		     kdump_get_err(ex->ctx));
+}
+
+uint64_t read_u64(struct extractor *ex, uint64_t kvaddr)
+{
+	uint64_t val;
+	read_or_fail(ex, KDUMP_KVADDR, kvaddr, &val, sizeof(val));
+	return val;
+}
+
+/*
+ * Check the magic, version and checksum of a descriptor. Version 1 descriptors
+ * are rejected, since they lack the fields needed to find the pages.
+ */
+bool desc_valid(const struct crashstash_desc *desc)
+{
+	struct crashstash_desc copy = *desc;
+
+	if (memcmp(desc->magic, CRASHSTASH_DESC_MAGIC, sizeof(desc->magic)) != 0)
+		return false;
+	if (desc->version != CRASHSTASH_DESC_VERSION)
+		return false;
+	copy.checksum = 0;
+	return crc32(&copy, sizeof(copy)) == desc->checksum;
+}
+
+bool desc_matches(const struct crashstash_desc *desc, const char *name)
+{
+	return strncmp(desc->name, name, sizeof(desc->name)) == 0;
+}
+
+/*
+ * The module logs a line like this whenever a stash is opened for writing:
+ *
+ *   crashstash: NAME: %s STASH: %llx SIZE: %llx PAGES: %llx META: %llx DESC: %llx
+ *
+ * The text of each record is stored contiguously in the log buffer, so there's
+ * no need to parse the log's record structure: just search the whole buffer,
+ * and take the last valid descriptor with the right name. The log buffer is
+ * found through vmcoreinfo: the printk ringbuffer's text data ring on 5.10 and
+ * later, or log_buf before that.
+ */
+bool find_log_buffer(struct extractor *ex, uint64_t *addr, uint64_t *len)
+{
+	uint64_t prb, text_ring, size_bits_off, data_off, sym;
+	uint32_t size_bits, log_buf_len;
+
+	if (vmcoreinfo_number(ex, "SYMBOL(prb)", &sym) &&
+	    vmcoreinfo_number(ex, "OFFSET(printk_ringbuffer.text_data_ring)", &text_ring) &&
+	    vmcoreinfo_number(ex, "OFFSET(prb_data_ring.size_bits)", &size_bits_off) &&
+	    vmcoreinfo_number(ex, "OFFSET(prb_data_ring.data)", &data_off)) {
+		prb = read_u64(ex, sym) + text_ring;
+		read_or_fail(ex, KDUMP_KVADDR, prb + size_bits_off,
+			     &size_bits, sizeof(size_bits));
+		*addr = read_u64(ex, prb + data_off);
+		*len = 1UL << size_bits;
+		return true;
+	}
+	if (vmcoreinfo_number(ex, "SYMBOL(log_buf)", &sym)) {
+		*addr = read_u64(ex, sym);
+		if (!vmcoreinfo_number(ex, "SYMBOL(log_buf_len)", &sym))
+			return false;
+		read_or_fail(ex, KDUMP_KVADDR, sym, &log_buf_len, sizeof(log_buf_len));
+		*len = log_buf_len;
+		return true;
+	}
+	return false;
+}
+
+bool find_desc_in_log(struct extractor *ex, const char *name,
+		      struct crashstash_desc *desc)
+{
+	static const char prefix[] = "crashstash: NAME: ";
+	uint64_t addr, len, desc_addr;
+	char line[256], found_name[CRASHSTASH_NAME_MAX];
+	bool found = false;
+	char *buf, *pos;
+
+	if (!find_log_buffer(ex, &addr, &len) || len > 256 * MB)
+		return false;
+	buf = malloc(len);
+	if (!buf)
+		perror_fail("malloc");
+	if (!try_read(ex, KDUMP_KVADDR, addr, buf, len)) {
+		free(buf);
+		return false;
+	}
+
+	pos = buf;
+	while ((pos = memmem(pos, len - (pos - buf), prefix, sizeof(prefix) - 1))) {
+		size_t n = len - (pos - buf);
+		struct crashstash_desc candidate;
+
+		if (n >= sizeof(line))
+			n = sizeof(line) - 1;
+		memcpy(line, pos, n);
+		line[n] = '\0';
+		pos += sizeof(prefix) - 1;
+
+		if (sscanf(line, "crashstash: NAME: %31s STASH: %*x SIZE: %*x "
+			   "PAGES: %*x META: %*x DESC: %lx", found_name, &desc_addr) != 2)
+			continue;
+		if (strcmp(found_name, name) != 0)
+			continue;
+		if (!try_read(ex, KDUMP_KVADDR, desc_addr, &candidate, sizeof(candidate)))
+			continue;
+		if (desc_valid(&candidate) && desc_matches(&candidate, name)) {
+			*desc = candidate;
+			found = true;
+		}
+	}
+	free(buf);
+	return found;
+}
+
+/*
+ * Each descriptor is at the start of its own page, so without a log message,
+ * check the start of every present page for the magic. With "list", print
+ * every descriptor found, rather than stopping at the one named.
+ */
+bool scan_for_desc(struct extractor *ex, const char *name, bool list,
+		   struct crashstash_desc *desc)
+{
+	kdump_status ks;
+	kdump_addr_t pfn = 0;
+	uint64_t pages = 0;
+	bool found = false;
+
+	while (1) {
+		kdump_addr_t begin, end;
+
+		ks = kdump_bmp_find_set(ex->pagemap, &pfn);
+		if (ks == KDUMP_ERR_NODATA)
+			break;
+		if (ks != KDUMP_OK)
+			fail("kdump_bmp_find_set: %s", kdump_bmp_get_err(ex->pagemap));
+		begin = pfn;
+		ks = kdump_bmp_find_clear(ex->pagemap, &pfn);
+		if (ks != KDUMP_OK)
+			fail("kdump_bmp_find_clear: %s", kdump_bmp_get_err(ex->pagemap));
+		end = pfn;
+
+		for (kdump_addr_t cur = begin; cur < end; cur++) {
+			struct crashstash_desc candidate;
+			uint64_t phys = cur << ex->page_shift;
+
+			pages++;
+			if (!try_read(ex, KDUMP_KPHYSADDR, phys, &candidate, sizeof(candidate)))
+				continue;
+			if (!desc_valid(&candidate))
+				continue;
+			if (list)
+				printf("%.*s\t0x%lx\n", CRASHSTASH_NAME_MAX,
+				       candidate.name, phys);
+			else if (desc_matches(&candidate, name)) {
+				*desc = candidate;
+				found = true;
+				goto out;
+			}
+		}
+	}
+out:
+	if (ex->verbose)
+		fprintf(stderr, "Scanned %lu pages for descriptors\n", pages);
+	return found;
+}
+
+/*
+ * Convert each chunk's struct page to a physical address. Stash memory is
+ * always in the direct map, and the memory map is linear (flat or vmemmap), so
+ * the descriptor's own page gives the base. Physically adjacent chunks are
+ * merged. Returns the number of extents.
+ */
+size_t walk_chunks(struct extractor *ex, const struct crashstash_desc *desc,
+		   struct extent *extents, uint64_t *storage)
+{
+	uint64_t self_pfn = desc->self_phys >> ex->page_shift;
+	uint64_t memmap = desc->self_page - self_pfn * ex->sizeof_page;
+	uint64_t node = read_u64(ex, desc->list);
+	size_t count = 0;
+
+	*storage = 0;
+	while (node != desc->list) {
+		uint64_t page = node - ex->offset_lru;
+		uint64_t order = read_u64(ex, page + ex->offset_private);
+		uint64_t pfn = (page - memmap) / ex->sizeof_page;
+		uint64_t phys = pfn << ex->page_shift;
+		uint64_t len = ex->page_size << order;
+
+		if ((page - memmap) % ex->sizeof_page || pfn > ex->max_pfn || order > 20)
+			fail("corrupt page list: page 0x%lx, order %lu\n", page, order);
+		if (count && extents[count - 1].phys + extents[count - 1].len == phys) {
+			extents[count - 1].len += len;
+		} else {
+			if (count == MAX_EXTENTS)
+				fail("corrupt page list: too many chunks\n");
+			extents[count].phys = phys;
+			extents[count].len = len;
+			count++;
+		}
+		*storage += len;
+		node = read_u64(ex, node);
+	}
+	return count;
+}
+
+/* Write "len" bytes of the stash storage from "off", in large reads */
+void write_range(struct extractor *ex, const struct extent *extents, size_t count,
+		 uint64_t off, uint64_t len, int fd, char *buf)
+{
+	for (size_t i = 0; i < count && len; i++) {
+		if (off >= extents[i].len) {
+			off -= extents[i].len;
+			continue;
+		}
+		while (len && off < extents[i].len) {
+			uint64_t amt = extents[i].len - off;
+			if (amt > len)
+				amt = len;
+			if (amt > MAX_READ)
+				amt = MAX_READ;
+			read_or_fail(ex, KDUMP_KPHYSADDR, extents[i].phys + off, buf, amt);
+			for (uint64_t done = 0; done < amt;) {
+				ssize_t rv = write(fd, buf + done, amt - done);
+				if (rv < 0)
+					perror_fail("write");
+				done += rv;
+			}
+			off += amt;
+			len -= amt;
+		}
+		off = 0;
+	}
+	if (len)
+		fail("stash storage ended early\n");
+}
+
+void help(void)
+{
+	puts(
+		"usage: crashstash_extract [OPTIONS] -c VMCORE [-n NAME] [-o OUTPUT]\n"
+		"\n"
+		"Writes the contents of a stash from a vmcore (ELF or kdump) to stdout, or to\n"
+		"the file indicated by OUTPUT, in the same format as reading the stash. This\n"
+		"needs no debuginfo, but the vmcore must be from the same architecture as\n"
+		"this host, and the module must have version 2 descriptors.\n"
+		"\n"
+		"  -c, --core VMCORE    specifies the vmcore to read (required)\n"
+		"  -n, --name NAME      the stash to extract (default: default)\n"
+		"  -o, --output OUTPUT  specifies where to write output (default: stdout)\n"
+		"  -a, --address PHYS   physical address of the stash's descriptor, as\n"
+		"                       printed by --list, to skip searching for it\n"
+		"  -l, --list           scan memory for every stash, and print their names\n"
+		"                       and descriptor addresses\n"
+		"  -r, --raw            write the raw storage of percpu and lz4 stashes\n"
+		"                       (use crashstash.py to decode those instead)\n"
+		"  --verbose, -v        prints timing information to stderr\n"
+		"  --help, -h           print this message and exit"
+	);
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+	struct extractor ex = {0};
+	struct crashstash_desc desc;
+	struct crashstash_meta meta;
+	struct extent *extents;
+	struct timespec start;
+	const char *name = "default";
+	const char *how;
+	uint64_t size, pages, storage, desc_phys = 0;
+	size_t count;
+	int in_fd = -1, out_fd = STDOUT_FILENO;
+	bool list = false, raw = false;
+	char *buf;
+
+	int opt;
+	const char *shopt = "c:n:o:a:lrvh";
+	static struct option lopt[] = {
+		{"core",    required_argument, NULL, 'c'},
+		{"name",    required_argument, NULL, 'n'},
+		{"output",  required_argument, NULL, 'o'},
+		{"address", required_argument, NULL, 'a'},
+		{"list",    no_argument,       NULL, 'l'},
+		{"raw",     no_argument,       NULL, 'r'},
+		{"verbose", no_argument,       NULL, 'v'},
+		{"help",    no_argument,       NULL, 'h'},
+		{0},
+	};
+	while ((opt = getopt_long(argc, argv, shopt, lopt, NULL)) != -1) {
+		switch (opt) {
+			case 'h':
+				help();
+				break;
+			case 'c':
+				in_fd = open(optarg, O_RDONLY);
+				if (in_fd < 0)
+					perror_fail("open vmcore");
+				break;
+			case 'n':
+				name = optarg;
+				break;
+			case 'o':
+				out_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC,
+					      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+				if (out_fd < 0)
+					perror_fail("open output");
+				break;
+			case 'a':
+				desc_phys = strtoull(optarg, NULL, 0);
+				break;
+			case 'l':
+				list = true;
+				break;
+			case 'r':
+				raw = true;
+				break;
+			case 'v':
+				ex.verbose = true;
+				break;
+			default:
+				fprintf(stderr, "Invalid argument\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (in_fd < 0)
+		fail("--core is a required argument! See -h for help output.\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	init_extractor(&ex, in_fd);
+
+	if (list) {
+		scan_for_desc(&ex, NULL, true, &desc);
+		kdump_free(ex.ctx);
+		return EXIT_SUCCESS;
+	}
+
+	if (desc_phys) {
+		how = "address";
+		read_or_fail(&ex, KDUMP_KPHYSADDR, desc_phys, &desc, sizeof(desc));
+		if (!desc_valid(&desc) || !desc_matches(&desc, name))
+			fail("no valid descriptor for \"%s\" at 0x%lx\n", name, desc_phys);
+	} else if (find_desc_in_log(&ex, name, &desc)) {
+		how = "kernel log";
+	} else if (scan_for_desc(&ex, name, false, &desc)) {
+		how = "memory scan";
+	} else {
+		fail("could not find a stash named \"%s\"\n", name);
+	}
+	if (ex.verbose)
+		fprintf(stderr, "Found descriptor at 0x%llx by %s (%.3fs)\n",
+			desc.self_phys, how, elapsed(&start));
+
+	size = read_u64(&ex, desc.size);
+	pages = read_u64(&ex, desc.pages);
+	read_or_fail(&ex, KDUMP_KVADDR, desc.meta, &meta, sizeof(meta));
+
+	extents = calloc(MAX_EXTENTS, sizeof(*extents));
+	buf = malloc(MAX_READ);
+	if (!extents || !buf)
+		perror_fail("malloc");
+	count = walk_chunks(&ex, &desc, extents, &storage);
+	if (storage != pages * ex.page_size)
+		fail("inconsistent page count for stash\n");
+
+	if (meta.flags & (CRASHSTASH_F_PERCPU | CRASHSTASH_F_LZ4)) {
+		if (!raw)
+			fail("\"%s\" is a %s stash: use --raw, or crashstash.py\n", name,
+			     (meta.flags & CRASHSTASH_F_PERCPU) ? "percpu" : "lz4");
+		write_range(&ex, extents, count, 0, storage, out_fd, buf);
+		size = storage;
+	} else if (meta.flags & CRASHSTASH_F_RING) {
+		/* The ring has only wrapped around if every page is allocated */
+		uint64_t tail, first;
+		if (!meta.capacity || size > storage)
+			fail("inconsistent metadata for ring stash\n");
+		tail = meta.tail % meta.capacity;
+		first = storage - tail < size ? storage - tail : size;
+		write_range(&ex, extents, count, tail, first, out_fd, buf);
+		write_range(&ex, extents, count, 0, size - first, out_fd, buf);
+	} else {
+		if (size > storage)
+			fail("inconsistent metadata for stash size\n");
+		write_range(&ex, extents, count, 0, size, out_fd, buf);
+	}
+
+	if (ex.verbose)
+		fprintf(stderr, "Wrote %lu bytes from %zu extents (%.3fs)\n",
+			size, count, elapsed(&start));
+	free(buf);
+	free(extents);
+	kdump_free(ex.ctx);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,317 @@
+/*
+ * libcrashstash: buffered, batched logging of binary records to a stash. See
+ * libcrashstash.h for the interface.
+ *
+ * gcc -O2 -Wall -pthread -c libcrashstash.c
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "libcrashstash.h"
+
+#define DEFAULT_BUF_SIZE (64 << 10)
+#define DEFAULT_BATCH_SIZE (1 << 20)
+#define DEFAULT_FLUSH_MS 100
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+/*
+ * One per thread which has logged. The lock is only contended when the flusher
+ * is copying the buffer out, or when the thread exits.
+ */
+struct buf {
+	pthread_mutex_t lock;
+	struct buf *next;
+	bool dead;       /* the thread has exited */
+	size_t len;
+	char data[];
+};
+
+struct libcrashstash {
+	int fd;
+	struct libcrashstash_opts opts;
+	pthread_key_t key;
+	uint64_t seq;
+	int error;       /* first failed write since the last flush */
+
+	pthread_mutex_t lock;  /* protects everything below */
+	pthread_cond_t cond;
+	struct buf *bufs;
+	char *batch;
+	size_t batch_len;
+	bool stop;
+	bool has_flusher;
+	pthread_t flusher;
+};
+
+/* Remember the first error, for libcrashstash_flush() to return */
+static int set_error(struct libcrashstash *cs, int err)
+{
+	int zero = 0;
+
+	__atomic_compare_exchange_n(&cs->error, &zero, err, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	return err;
+}
+
+static int write_out(struct libcrashstash *cs, const void *data, size_t len)
+{
+	int err = 0;
+
+	while (len) {
+		ssize_t rv = write(cs->fd, data, len);
+
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0) {
+			err = set_error(cs, rv < 0 ? -errno : -ENOSPC);
+			break;
+		}
+		data = (const char *)data + rv;
+		len -= rv;
+	}
+	return err;
+}
+
+/* Called with cs->lock held: copy every buffer into batches, and write them */
+static void flush_locked(struct libcrashstash *cs)
+{
+	struct buf **pb = &cs->bufs, *b;
+
+	while ((b = *pb)) {
+		bool dead;
+
+		pthread_mutex_lock(&b->lock);
+		if (cs->batch_len + b->len > cs->opts.batch_size) {
+			write_out(cs, cs->batch, cs->batch_len);
+			cs->batch_len = 0;
+		}
+		memcpy(cs->batch + cs->batch_len, b->data, b->len);
+		cs->batch_len += b->len;
+		b->len = 0;
+		dead = b->dead;
+		pthread_mutex_unlock(&b->lock);
+
+		if (dead) {
+			*pb = b->next;
+			pthread_mutex_destroy(&b->lock);
+			free(b);
+		} else {
+			pb = &b->next;
+		}
+	}
+	if (cs->batch_len) {
+		write_out(cs, cs->batch, cs->batch_len);
+		cs->batch_len = 0;
+	}
+}
+
+static void *flusher(void *arg)
+{
+	struct libcrashstash *cs = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&cs->lock);
+	while (!cs->stop) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += cs->opts.flush_ms / 1000;
+		deadline.tv_nsec += (cs->opts.flush_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&cs->cond, &cs->lock, &deadline);
+		if (!cs->stop)
+			flush_locked(cs);
+	}
+	pthread_mutex_unlock(&cs->lock);
+	return NULL;
+}
+
+/* Thread exit: the flusher writes out what's left, and frees the buffer */
+static void buf_exit(void *arg)
+{
+	struct buf *b = arg;
+
+	pthread_mutex_lock(&b->lock);
+	b->dead = true;
+	pthread_mutex_unlock(&b->lock);
+}
+
+static struct buf *get_buf(struct libcrashstash *cs)
+{
+	struct buf *b = pthread_getspecific(cs->key);
+
+	if (b)
+		return b;
+	b = calloc(1, sizeof(*b) + cs->opts.buf_size);
+	if (!b)
+		return NULL;
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_mutex_lock(&cs->lock);
+	b->next = cs->bufs;
+	cs->bufs = b;
+	pthread_mutex_unlock(&cs->lock);
+	pthread_setspecific(cs->key, b);
+	return b;
+}
+
+struct libcrashstash *libcrashstash_open(const char *name,
+					 const struct libcrashstash_opts *opts)
+{
+	struct libcrashstash *cs = calloc(1, sizeof(*cs));
+	pthread_condattr_t attr;
+	sigset_t all, old;
+	char path[PATH_MAX];
+	int rv;
+
+	if (!cs)
+		return NULL;
+	if (opts)
+		cs->opts = *opts;
+	if (!cs->opts.buf_size)
+		cs->opts.buf_size = DEFAULT_BUF_SIZE;
+	if (!cs->opts.batch_size)
+		cs->opts.batch_size = DEFAULT_BATCH_SIZE;
+	if (cs->opts.batch_size < cs->opts.buf_size)
+		cs->opts.batch_size = cs->opts.buf_size;
+	if (!cs->opts.flush_ms)
+		cs->opts.flush_ms = DEFAULT_FLUSH_MS;
+
+	cs->batch = malloc(cs->opts.batch_size);
+	if (!cs->batch)
+		goto out_free;
+	snprintf(path, sizeof(path), "/proc/crashstash/%s", name);
+	cs->fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (cs->fd < 0)
+		goto out_free;
+	rv = pthread_key_create(&cs->key, buf_exit);
+	if (rv) {
+		errno = rv;
+		goto out_close;
+	}
+	pthread_mutex_init(&cs->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cs->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (!cs->opts.no_flusher) {
+		/* keep the application's signal handlers off the flusher */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		rv = pthread_create(&cs->flusher, NULL, flusher, cs);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (rv) {
+			errno = rv;
+			goto out_key;
+		}
+		cs->has_flusher = true;
+	}
+	return cs;
+
+out_key:
+	pthread_cond_destroy(&cs->cond);
+	pthread_mutex_destroy(&cs->lock);
+	pthread_key_delete(cs->key);
+out_close:
+	rv = errno;
+	close(cs->fd);
+	errno = rv;
+out_free:
+	free(cs->batch);
+	free(cs);
+	return NULL;
+}
+
+int libcrashstash_log(struct libcrashstash *cs, uint32_t type,
+		      const void *data, size_t len)
+{
+	static const char zeroes[8];
+	struct libcrashstash_rec rec;
+	struct timespec ts;
+	struct buf *b = get_buf(cs);
+	size_t need = sizeof(rec) + ALIGN8(len);
+	int rv = 0;
+
+	if (!b)
+		return -ENOMEM;
+	if (len > UINT32_MAX)
+		return -EFBIG;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec.ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec.seq = __atomic_fetch_add(&cs->seq, 1, __ATOMIC_RELAXED);
+	rec.type = type;
+	rec.len = len;
+
+	pthread_mutex_lock(&b->lock);
+	if (b->len + need > cs->opts.buf_size && b->len) {
+		rv = write_out(cs, b->data, b->len);
+		b->len = 0;
+	}
+	if (need > cs->opts.buf_size) {
+		/* too big to buffer: write it as a batch of its own */
+		struct iovec iov[3] = {
+			{ &rec, sizeof(rec) },
+			{ (void *)data, len },
+			{ (void *)zeroes, need - sizeof(rec) - len },
+		};
+		ssize_t wrote = writev(cs->fd, iov, 3);
+
+		if (wrote != need)
+			rv = set_error(cs, wrote < 0 ? -errno : -ENOSPC);
+	} else {
+		memcpy(b->data + b->len, &rec, sizeof(rec));
+		memcpy(b->data + b->len + sizeof(rec), data, len);
+		memset(b->data + b->len + sizeof(rec) + len, 0, need - sizeof(rec) - len);
+		b->len += need;
+	}
+	pthread_mutex_unlock(&b->lock);
+	return rv;
+}
+
+int libcrashstash_flush(struct libcrashstash *cs)
+{
+	pthread_mutex_lock(&cs->lock);
+	flush_locked(cs);
+	pthread_mutex_unlock(&cs->lock);
+	return __atomic_exchange_n(&cs->error, 0, __ATOMIC_RELAXED);
+}
+
+int libcrashstash_close(struct libcrashstash *cs)
+{
+	struct buf *b, *next;
+	int rv;
+
+	if (cs->has_flusher) {
+		pthread_mutex_lock(&cs->lock);
+		cs->stop = true;
+		pthread_cond_signal(&cs->cond);
+		pthread_mutex_unlock(&cs->lock);
+		pthread_join(cs->flusher, NULL);
+	}
+	rv = libcrashstash_flush(cs);
+	pthread_key_delete(cs->key);
+	for (b = cs->bufs; b; b = next) {
+		next = b->next;
+		pthread_mutex_destroy(&b->lock);
+		free(b);
+	}
+	pthread_cond_destroy(&cs->cond);
+	pthread_mutex_destroy(&cs->lock);
+	close(cs->fd);
+	free(cs->batch);
+	free(cs);
+	return rv;
+}
@@ -0,0 +1,76 @@
+/*
+ * libcrashstash: buffered, batched logging of binary records to a stash.
+ *
+ * Writing each record to /proc/crashstash directly costs a syscall and the
+ * stash mutex. Instead, each thread appends records to its own buffer, and a
+ * background thread periodically writes all the buffers out with a few large
+ * write() calls:
+ *
+ *   struct libcrashstash *cs = libcrashstash_open("myservice", NULL);
+ *
+ *   libcrashstash_log(cs, MY_EVENT, &event, sizeof(event));
+ *   ...
+ *   libcrashstash_flush(cs);   // before doing something dangerous
+ *   ...
+ *   libcrashstash_close(cs);
+ *
+ * Records only reach the kernel (and so the vmcore) when they are flushed, so
+ * anything logged since the last flush is lost if the kernel crashes. A ring
+ * mode stash is the best fit, since opening it doesn't clear it, and it keeps
+ * the most recent batches once full.
+ */
+#ifndef _LIBCRASHSTASH_H
+#define _LIBCRASHSTASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Each record starts with this header, and its data is padded to a multiple of
+ * 8 bytes. Each write() contains a whole number of records. The timestamp is
+ * CLOCK_MONOTONIC, and the sequence number is shared by every thread, so gaps
+ * show where records were lost.
+ */
+struct libcrashstash_rec {
+	uint64_t ts;
+	uint64_t seq;
+	uint32_t type;
+	uint32_t len;
+};
+
+struct libcrashstash_opts {
+	size_t buf_size;        /* per-thread buffer size (default 64 KiB) */
+	size_t batch_size;      /* largest write() (default 1 MiB) */
+	unsigned int flush_ms;  /* flusher interval (default 100ms) */
+	int no_flusher;         /* only write on libcrashstash_flush() or when full */
+};
+
+struct libcrashstash;
+
+/*
+ * Open /proc/crashstash/NAME for writing. opts may be NULL, and any zero
+ * option gets its default. Returns NULL with errno set on failure.
+ */
+struct libcrashstash *libcrashstash_open(const char *name,
+					 const struct libcrashstash_opts *opts);
+
+/*
+ * Append a record to the calling thread's buffer, writing the buffer out first
+ * if the record doesn't fit. Returns 0, or a negative errno if a write failed.
+ */
+int libcrashstash_log(struct libcrashstash *cs, uint32_t type,
+		      const void *data, size_t len);
+
+/*
+ * Write out every thread's buffer now. Returns 0, or a negative errno for the
+ * first write which failed since the last call.
+ */
+int libcrashstash_flush(struct libcrashstash *cs);
+
+/*
+ * Flush, stop the flusher, and free everything. No thread may be logging at
+ * the same time. Returns the result of the final flush.
+ */
+int libcrashstash_close(struct libcrashstash *cs);
+
+#endif /* _LIBCRASHSTASH_H */
@@ -10,12 +10,25 @@
 #include <assert.h>
 
 #include <byteswap.h>
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
 
 #include <elf.h>
+#include <openssl/evp.h>
 
 bool verbose;
 
@@ -30,6 +43,8 @@ bool verbose;
 struct elfinfo {
 	int endian;  /* ELFDATA2LSB or ELFDATA2MSB */
 	int bits;    /* ELFCLASS64 or ELFCLASS32 */
+	void *data;  /* the whole file, mapped read-only */
+	size_t size;
 };
 
 #if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
@@ -102,20 +117,16 @@ static size_t pad4(size_t val)
 	return val;
 }
 
-static void *note_desc(void *nhdr, uint16_t namesz)
+static void *note_desc(void *nhdr, uint32_t namesz)
 {
 	return nhdr + sizeof(Elf64_Nhdr) + pad4(namesz);
 }
 
-static void *next_note(void *nhdr, uint16_t namesz, uint16_t descsz)
+static void *next_note(void *nhdr, uint32_t namesz, uint32_t descsz)
 {
 	return nhdr + sizeof(Elf64_Nhdr) + pad4(namesz) + pad4(descsz);
 }
 
-static bool end_notes(void *start, size_t len, void *ptr)
-{
-	return ((uintptr_t)ptr - (uintptr_t)start) >= len;
-}
 
 static inline char nibble_to_hex(uint8_t input)
 {
@@ -190,53 +201,51 @@ struct buildid_info {
 	char *hex;
 };
 
-static void *fetch_data(int fd, uint64_t offset, size_t len)
+/*
+ * Return a pointer to the given range of the mapped file, or NULL if it
+ * extends past the end of the file.
+ */
+static void *fetch_data(struct elfinfo *info, uint64_t offset, uint64_t len)
 {
-	int rv;
-	void *data;
-
-	if (lseek(fd, offset, SEEK_SET) == (loff_t) -1) {
-		fprintf(stderr, "error seeking to notes location %"PRIu64"\n", offset);
-		perror("lseek");
+	if (offset > info->size || len > info->size - offset) {
+		fprintf(stderr, "error: data at offset %"PRIu64" (size %"PRIu64
+			") is beyond the end of the file\n", offset, len);
 		return NULL;
 	}
-
-	data = calloc(len, 1);
-	rv = read(fd, data, len);
-	if (rv != len) {
-		fprintf(stderr, "error: read notes data failed (%d)\n", rv);
-		if (rv < 0)
-			perror("read");
-		free(data);
-		return NULL;
-	}
-	return data;
+	return info->data + offset;
 }
 
-static int find_buildid(int fd, struct elfinfo *info, uint64_t offset, size_t len,
-			struct buildid_info *info_out)
+/*
+ * Search the notes in data, which holds len bytes read from the given offset
+ * of the file.
+ */
+static int find_buildid_in(struct elfinfo *info, void *data, uint64_t offset,
+			   size_t len, struct buildid_info *info_out)
 {
-	void *data = fetch_data(fd, offset, len);
+	void *end = data + len;
 	void *nhdr;
 
-	if (!data)
-		return -1;
-
-	nhdr = data;
-	while (!end_notes(data, len, nhdr)) {
-		char *name = nhdr + sizeof(Elf64_Nhdr); /* Note: same structure size */
+	/* Note: Elf32_Nhdr and Elf64_Nhdr are the same size */
+	for (nhdr = data; nhdr + sizeof(Elf64_Nhdr) <= end;) {
+		char *name = nhdr + sizeof(Elf64_Nhdr);
 		uint32_t descsz = getfield32(info, nhdr, Nhdr, n_descsz);
 		uint32_t namesz = getfield32(info, nhdr, Nhdr, n_namesz);
 		uint32_t type = getfield32(info, nhdr, Nhdr, n_type);
 
-		if ((strcmp("GNU", name) == 0) &&
-		    (type == NT_GNU_BUILD_ID)) {
+		if (pad4(namesz) + pad4(descsz) > end - (void *)name) {
+			fprintf(stderr, "error: truncated note at offset %"PRIu64"\n",
+				offset + (nhdr - data));
+			return -1;
+		}
+		if (namesz == 4 && memcmp("GNU", name, 4) == 0 &&
+		    type == NT_GNU_BUILD_ID) {
 			size_t desc_offset_in_sect;
 
 			/* This is just a sanity-check, it should never be hit */
 			if (descsz > MAX_BUILDID_SIZE) {
 				fprintf(stderr, "error: Found build ID of large size %"
 					PRIu32", skipping\n", descsz);
+				nhdr = next_note(nhdr, namesz, descsz);
 				continue;
 			}
 			if (descsz != 20 && descsz != 16)
@@ -247,15 +256,23 @@ static int find_buildid(int fd, struct elfinfo *info, uint64_t offset, size_t le
 			info_out->data_offset = offset + desc_offset_in_sect;
 			info_out->bytes_size = (size_t) descsz;
 			info_out->hex = to_hex(note_desc(nhdr, namesz), descsz);
-			free(data);
 			return 1;
 		}
 		nhdr = next_note(nhdr, namesz, descsz);
 	}
-	free(data);
 	return 0;
 }
 
+static int find_buildid(struct elfinfo *info, uint64_t offset, size_t len,
+			struct buildid_info *info_out)
+{
+	void *data = fetch_data(info, offset, len);
+
+	if (!data)
+		return -1;
+	return find_buildid_in(info, data, offset, len, info_out);
+}
+
 static int find_notes_phdr(void *entries, struct elfinfo *info, int start,
 			   uint16_t e_phnum, uint16_t e_phentsize,
 			   uint64_t *offset_out, uint64_t *size_out)
@@ -277,7 +294,7 @@ static int find_notes_phdr(void *entries, struct elfinfo *info, int start,
 	return -1;
 }
 
-static int find_buildid_phdr(int fd, struct elfinfo *info, void *ehdr,
+static int find_buildid_phdr(struct elfinfo *info, void *ehdr,
 			     struct buildid_info *info_out)
 {
 	void *phdr;
@@ -293,14 +310,14 @@ static int find_buildid_phdr(int fd, struct elfinfo *info, void *ehdr,
 		pr_info("ELF file has no program header\n");
 		return 0;
 	}
-	phdr = fetch_data(fd, e_phoff, e_phnum * e_phentsize);
+	phdr = fetch_data(info, e_phoff, e_phnum * e_phentsize);
 	if (!phdr)
 		return -1;
 
 	while ((start = find_notes_phdr(phdr, info, start, e_phnum,
 					e_phentsize, &offset, &size)) >= 0) {
 		pr_info("Found NOTES section in program header index %d\n", start);
-		rv = find_buildid(fd, info, offset, size, info_out);
+		rv = find_buildid(info, offset, size, info_out);
 
 		/*
 		 * Continue searching on 0 (not found). Otherwise, either we
@@ -313,9 +330,8 @@ static int find_buildid_phdr(int fd, struct elfinfo *info, void *ehdr,
 		start += 1; /* continue from next */
 	}
 	pr_info("Program header did not contain NOTES segment with Build ID note.\n");
-
+	rv = 0;
 out:
-	free(phdr);
 	return rv;
 }
 
@@ -339,7 +355,7 @@ static int find_notes_shdr(void *entries, struct elfinfo *info, int start,
 	return -1;
 }
 
-static int find_buildid_shdr(int fd, struct elfinfo *info, void *ehdr,
+static int find_buildid_shdr(struct elfinfo *info, void *ehdr,
 			     struct buildid_info *info_out)
 {
 	void *shdr;
@@ -355,14 +371,14 @@ static int find_buildid_shdr(int fd, struct elfinfo *info, void *ehdr,
 		pr_info("ELF file has no section header\n");
 		return 0;
 	}
-	shdr = fetch_data(fd, e_shoff, e_shnum * e_shentsize);
+	shdr = fetch_data(info, e_shoff, e_shnum * e_shentsize);
 	if (!shdr)
 		return -1;
 
 	while ((start = find_notes_shdr(shdr, info, start, e_shnum,
 					e_shentsize, &offset, &size)) >= 0) {
 		pr_info("Found NOTES section in section header index %d\n", start);
-		rv = find_buildid(fd, info, offset, size, info_out);
+		rv = find_buildid(info, offset, size, info_out);
 
 		/*
 		 * Continue searching on 0 (not found). Otherwise, either we
@@ -375,32 +391,80 @@ static int find_buildid_shdr(int fd, struct elfinfo *info, void *ehdr,
 		start += 1; /* continue from next */
 	}
 	pr_info("Section header did not contain NOTES segment with Build ID note.\n");
-
+	rv = 0;
 out:
-	free(shdr);
 	return rv;
 }
 
-static int find_build_id(int fd, struct buildid_info *info_out)
+/*
+ * Find the section with the given name, using the section header string table.
+ * Returns its index and sets offset_out and size_out, or returns 0 if there is
+ * no such section, and -1 on error.
+ */
+static int find_named_shdr(struct elfinfo *info, void *ehdr, const char *name,
+			   uint64_t *offset_out, uint64_t *size_out)
 {
-	int rv;
-	char ehdrbuf[max(sizeof(Elf64_Ehdr), sizeof(Elf32_Ehdr))];
-	Elf64_Ehdr *ehdr64 = (Elf64_Ehdr *)&ehdrbuf;
-	struct elfinfo info;
+	void *shdr, *strtab_shdr;
+	char *strtab;
+	uint64_t strtab_size;
+	uint32_t shstrndx;
+	int i;
 
-	rv = read(fd, ehdrbuf, sizeof(ehdrbuf));
-	if (rv != sizeof(ehdrbuf)) {
-		fprintf(stderr, "read ELF header failed (%d)\n", rv);
-		if (rv < 0)
-			perror("read");
+	uint16_t e_shnum = getfield16(info, ehdr, Ehdr, e_shnum);
+	uint64_t e_shoff = getaddr(info, ehdr, Ehdr, e_shoff);
+	uint16_t e_shentsize = getfield16(info, ehdr, Ehdr, e_shentsize);
+
+	if (!e_shnum) {
+		pr_info("ELF file has no section header\n");
+		return 0;
+	}
+	shdr = fetch_data(info, e_shoff, e_shnum * e_shentsize);
+	if (!shdr)
+		return -1;
+
+	/* A large index is stored in the sh_link of the first section */
+	shstrndx = getfield16(info, ehdr, Ehdr, e_shstrndx);
+	if (shstrndx == SHN_XINDEX)
+		shstrndx = getfield32(info, shdr, Shdr, sh_link);
+	if (shstrndx == SHN_UNDEF || shstrndx >= e_shnum) {
+		pr_info("ELF file has no section header string table\n");
+		return 0;
+	}
+	strtab_shdr = shdr + shstrndx * e_shentsize;
+	strtab_size = getaddr(info, strtab_shdr, Shdr, sh_size);
+	strtab = fetch_data(info, getaddr(info, strtab_shdr, Shdr, sh_offset), strtab_size);
+	if (!strtab)
 		return -1;
+
+	for (i = 1; i < e_shnum; i++) {
+		void *sec = shdr + i * e_shentsize;
+		uint32_t sh_name = getfield32(info, sec, Shdr, sh_name);
+
+		if (sh_name >= strtab_size ||
+		    strnlen(strtab + sh_name, strtab_size - sh_name) == strtab_size - sh_name ||
+		    strcmp(strtab + sh_name, name) != 0)
+			continue;
+		*offset_out = getaddr(info, sec, Shdr, sh_offset);
+		*size_out = getaddr(info, sec, Shdr, sh_size);
+		return i;
 	}
+	return 0;
+}
+
+/*
+ * Check the ELF header of the file mapped at info->data, and fill in its class
+ * and byte order. Returns 0, or -1 if it isn't a supported ELF file.
+ */
+static int parse_ehdr(struct elfinfo *info)
+{
+	Elf64_Ehdr *ehdr64 = info->data;
 
 	/*
 	 * To simplify things, we can access the first few bytes using Elf64
 	 * structure. The definitions are the same.
 	 */
-	if (!(ehdr64->e_ident[0] == ELFMAG0 && ehdr64->e_ident[1] == ELFMAG1 &&
+	if (info->size < EI_NIDENT ||
+	    !(ehdr64->e_ident[0] == ELFMAG0 && ehdr64->e_ident[1] == ELFMAG1 &&
 	      ehdr64->e_ident[2] == ELFMAG2 && ehdr64->e_ident[3] == ELFMAG3)) {
 		fprintf(stderr, "error: not an ELF file\n");
 		return -1;
@@ -410,137 +474,2027 @@ static int find_build_id(int fd, struct buildid_info *info_out)
 	 * We can handle 32 and 64 bits, and big/little endian!
 	 * But it's helpful to verify and log this information.
 	 */
-	info.bits = ehdr64->e_ident[EI_CLASS];
-	if (info.bits == ELFCLASS32 || info.bits == ELFCLASS64) {
-		pr_info("Input is a %d-bit ELF\n", info.bits == ELFCLASS32 ? 32 : 64);
+	info->bits = ehdr64->e_ident[EI_CLASS];
+	if (info->bits == ELFCLASS32 || info->bits == ELFCLASS64) {
+		pr_info("Input is a %d-bit ELF\n", info->bits == ELFCLASS32 ? 32 : 64);
 	} else {
-		fprintf(stderr, "Error: unsupported elf class: %d\n", info.bits);
+		fprintf(stderr, "Error: unsupported elf class: %d\n", info->bits);
 		return -1;
 	}
-	info.endian = ehdr64->e_ident[EI_DATA];
-	if (info.endian == ELFDATA2LSB || info.endian == ELFDATA2MSB) {
-		pr_info("Input is %s-endian\n", info.endian == ELFDATA2LSB ? "little" : "big");
+	info->endian = ehdr64->e_ident[EI_DATA];
+	if (info->endian == ELFDATA2LSB || info->endian == ELFDATA2MSB) {
+		pr_info("Input is %s-endian\n", info->endian == ELFDATA2LSB ? "little" : "big");
 	} else {
-		fprintf(stderr, "Error: unsupported elf data encoding: %d\n", info.endian);
+		fprintf(stderr, "Error: unsupported elf data encoding: %d\n", info->endian);
+		return -1;
+	}
+	if (info->size < (info->bits == ELFCLASS64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr))) {
+		fprintf(stderr, "error: truncated ELF header\n");
 		return -1;
 	}
+	return 0;
+}
+
+/*
+ * Find the build ID in an ELF file which has already been mapped into
+ * info->data. Returns 1 if found, 0 if not, and -1 on error.
+ */
+static int find_build_id_mapped(struct elfinfo *info, struct buildid_info *info_out)
+{
+	int rv;
+
+	if (parse_ehdr(info) < 0)
+		return -1;
 
 	/*
 	 * Notes are legal to be declared in program headers or section headers.
 	 * In manual tests, we have found NOTES declared in either place. So, we
 	 * should support both.
 	 */
-	rv = find_buildid_phdr(fd, &info, (void *)ehdrbuf, info_out);
+	rv = find_buildid_phdr(info, info->data, info_out);
 	if (rv != 0)
 		return rv;
 
-	return find_buildid_shdr(fd, &info, (void *)ehdrbuf, info_out);
+	return find_buildid_shdr(info, info->data, info_out);
 }
 
-static int write_new_buildid(int fd, size_t offset, uint8_t *data, size_t data_size)
+/*
+ * Map the file read-only, so that we only touch the pages holding the headers
+ * and notes, rather than reading them all into buffers.
+ */
+static int find_build_id(int fd, struct buildid_info *info_out)
 {
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		fprintf(stderr, "error: seeking to build id bytes\n");
-		perror("lseek");
+	int rv;
+	struct stat st;
+	struct elfinfo info;
+
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		return -1;
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "error: not an ELF file\n");
 		return -1;
 	}
+	info.size = st.st_size;
+	info.data = mmap(NULL, info.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (info.data == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	rv = find_build_id_mapped(&info, info_out);
+	munmap(info.data, info.size);
+	return rv;
+}
 
-	if (write(fd, data, data_size) < 0)
-		perror("write");
+static int write_new_buildid(int fd, size_t offset, uint8_t *data, size_t data_size)
+{
+	ssize_t rv = pwrite(fd, data, data_size, offset);
 
+	if (rv < 0) {
+		perror("pwrite");
+		return -1;
+	} else if (rv != data_size) {
+		fprintf(stderr, "error: short write of build ID (%zd)\n", rv);
+		return -1;
+	}
 	return 0;
 }
 
-void help(void)
+/*
+ * Recompute a build ID the way the linker does: hash the file with the build ID
+ * itself zeroed. The hash is chosen by the size of the existing ID: SHA-1 for
+ * 20 bytes, and MD5 for 16. OpenSSL uses the CPU's SHA extensions or
+ * vectorized code where it can. Each linker hashes something different:
+ *
+ * - GNU ld (binutils' _bfd_elf_checksum_contents) hashes the ELF header and
+ *   program headers, then each section header and its contents. File offsets
+ *   in the headers are zeroed, and the whole build ID note (not just the ID)
+ *   is zero when it is hashed. The symbol table and string tables have no
+ *   contents in memory at that point, so only their headers are hashed.
+ * - gold hashes the whole file in one pass ("flat").
+ * - lld uses a tree hash: the file is split into 1 MiB chunks, each chunk is
+ *   hashed, and the build ID is the hash of the concatenated chunk hashes.
+ *   That lets the chunks be hashed in parallel.
+ *
+ * By default, the style is picked from the markers each linker leaves: gold
+ * adds a .note.gnu.gold-version section, and lld puts "Linker: LLD" in
+ * .comment. Anything else is assumed to be from GNU ld.
+ */
+#define HASH_CHUNK (1 << 20)
+#define NOTE_HEADER_SIZE (sizeof(Elf64_Nhdr) + 4)  /* header and "GNU\0" */
+
+enum hash_style {
+	HASH_AUTO,
+	HASH_GNU,
+	HASH_FLAT,
+	HASH_TREE,
+};
+
+static const char *HASH_STYLE_NAMES[] = {
+	[HASH_AUTO] = "auto",
+	[HASH_GNU] = "gnu",
+	[HASH_FLAT] = "flat",
+	[HASH_TREE] = "tree",
+};
+
+/* A range of the file which is hashed as zeroes */
+struct hash_zero {
+	uint64_t offset;
+	size_t size;
+};
+
+/*
+ * Hash the given range of the mapped file, with any part of it inside the
+ * zeroed range replaced by zeroes. Returns 0, or -1 if a digest call failed.
+ */
+static int digest_zeroed(EVP_MD_CTX *ctx, const uint8_t *data, uint64_t offset,
+			 size_t len, const struct hash_zero *zero)
 {
-	puts(
-		"usage: editbuildid [-n BUILD-ID] [-p] [-v] [-h] ELF-FILE\n"
-		"\n"
-		"Find the build ID of an ELF file and either print it (-p) and exit, or\n"
-		"overwrite it with the given value (-n BUILD-ID). The -p and -n options\n"
-		"are mutually exclusive and exactly one must be specified.\n"
-		"\n"
-		"Options:\n"
-		"  -n, --new BUILD-ID   specify the new BUILD-ID value\n"
-		"  -p, --print          print the current build ID value and exit\n"
-		"  -v, --verbose        print informational messages\n"
-		"  -h, --help           print this message and exit\n"
-		"\n"
-		"Stephen Brennan <stephen.s.brennan@oracle.com>"
-	);
-	exit(EXIT_SUCCESS);
+	static const uint8_t zeroes[NOTE_HEADER_SIZE + MAX_BUILDID_SIZE];
+	uint64_t from = max(zero->offset, offset);
+	uint64_t to = zero->offset + zero->size;
+
+	if (to > offset + len)
+		to = offset + len;
+	if (from >= to)
+		return EVP_DigestUpdate(ctx, data + offset, len) ? 0 : -1;
+	if (!EVP_DigestUpdate(ctx, data + offset, from - offset) ||
+	    !EVP_DigestUpdate(ctx, zeroes, to - from) ||
+	    !EVP_DigestUpdate(ctx, data + to, offset + len - to))
+		return -1;
+	return 0;
 }
 
-int main(int argc, char **argv)
+struct hash_job {
+	const EVP_MD *md;
+	const uint8_t *data;
+	size_t size;
+	struct hash_zero zero;
+	uint8_t *hashes;     /* one per chunk */
+	size_t hash_size;
+	size_t nchunks;
+	int nthreads;
+	int thread;
+	int error;
+};
+
+static void *hash_chunks(void *arg)
 {
-	struct buildid_info info;
-	char *newid_hex = NULL;
-	char *elf_file = NULL;
-	uint8_t *newid_bytes = NULL;
-	size_t newid_len = 0;
-	int elf_fd, opt, rv = 0;
-	bool print = false;
+	struct hash_job *job = arg;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	size_t i;
 
-	const char *shopt = "n:vhp";
-	static struct option lopt[] = {
-		{"--new",     required_argument, NULL, 'n'},
-		{"--verbose", no_argument,       NULL, 'v'},
-		{"--help",    no_argument,       NULL, 'h'},
-		{"--print",   no_argument,       NULL, 'p'},
-	};
-	while ((opt = getopt_long(argc, argv, shopt, lopt, NULL)) != -1) {
-		switch (opt) {
-		case 'h':
-		case '?':
-			help();
-			break;
-		case 'v':
-			verbose = true;
-			break;
-		case 'p':
-			print = true;
-			break;
-		case 'n':
-			newid_hex = optarg;
+	if (!ctx) {
+		job->error = -1;
+		return NULL;
+	}
+	for (i = job->thread; i < job->nchunks; i += job->nthreads) {
+		uint64_t start = (uint64_t)i * HASH_CHUNK;
+		size_t len = job->size - start < HASH_CHUNK ? job->size - start : HASH_CHUNK;
+
+		if (!EVP_DigestInit_ex(ctx, job->md, NULL) ||
+		    digest_zeroed(ctx, job->data, start, len, &job->zero) < 0 ||
+		    !EVP_DigestFinal_ex(ctx, job->hashes + i * job->hash_size, NULL)) {
+			job->error = -1;
 			break;
 		}
 	}
-	argv += optind;
-	argc -= optind;
+	EVP_MD_CTX_free(ctx);
+	return NULL;
+}
 
-	if (argc != 1) {
-		fprintf(stderr, "error: require exactly one argument (ELF-FILE)\n");
-		return 1;
+static int hash_tree(struct elfinfo *elf, const EVP_MD *evp, const struct hash_zero *zero,
+		     int nthreads, uint8_t *md)
+{
+	struct hash_job *jobs = calloc(nthreads, sizeof(*jobs));
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+	size_t hash_size = EVP_MD_size(evp);
+	size_t nchunks = (elf->size + HASH_CHUNK - 1) / HASH_CHUNK;
+	uint8_t *hashes = malloc(nchunks * hash_size);
+	int i, rv = -1;
+
+	if (!jobs || !threads || !hashes) {
+		fprintf(stderr, "error: out of memory\n");
+		goto out;
 	}
-	if (print && newid_hex) {
-		fprintf(stderr, "error: --print and --new are mutually exclusive\n");
-		return 1;
-	} else if (!(print || newid_hex)) {
-		fprintf(stderr, "error: either --print or --new should be specified\n");
-		return 1;
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].md = evp;
+		jobs[i].data = elf->data;
+		jobs[i].size = elf->size;
+		jobs[i].zero = *zero;
+		jobs[i].hash_size = hash_size;
+		jobs[i].nchunks = nchunks;
+		jobs[i].hashes = hashes;
+		jobs[i].nthreads = nthreads;
+		jobs[i].thread = i;
+		if (i && pthread_create(&threads[i], NULL, hash_chunks, &jobs[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
 	}
-	elf_file = argv[0];
-	memset(&info, 0, sizeof(info));
+	hash_chunks(&jobs[0]);
+	rv = jobs[0].error;
+	for (i = 1; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		rv |= jobs[i].error;
+	}
+	if (rv == 0 && !EVP_Digest(hashes, nchunks * hash_size, md, NULL, evp, NULL))
+		rv = -1;
+out:
+	free(hashes);
+	free(threads);
+	free(jobs);
+	return rv;
+}
 
-	elf_fd = open(elf_file, O_RDWR, 0);
-	if (elf_fd < 0) {
-		fprintf(stderr, "failed to open %s to read\n", elf_file);
-		perror("open");
-		return 1;
+static int hash_gnu(struct elfinfo *elf, EVP_MD_CTX *ctx, const struct hash_zero *zero)
+{
+	void *ehdr = elf->data, *shdrs, *phdrs;
+	union {
+		Elf64_Ehdr e64;
+		Elf32_Ehdr e32;
+		Elf64_Shdr s64;
+		Elf32_Shdr s32;
+	} copy;
+	bool is64 = elf->bits == ELFCLASS64;
+	size_t ehdr_size = is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+	size_t shdr_size = is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+	uint64_t e_phoff = getaddr(elf, ehdr, Ehdr, e_phoff);
+	uint64_t e_shoff = getaddr(elf, ehdr, Ehdr, e_shoff);
+	uint16_t e_phnum = getfield16(elf, ehdr, Ehdr, e_phnum);
+	uint16_t e_phentsize = getfield16(elf, ehdr, Ehdr, e_phentsize);
+	uint16_t e_shnum = getfield16(elf, ehdr, Ehdr, e_shnum);
+	uint16_t e_shentsize = getfield16(elf, ehdr, Ehdr, e_shentsize);
+	uint16_t e_shstrndx = getfield16(elf, ehdr, Ehdr, e_shstrndx);
+	uint32_t symstr = SHN_UNDEF;
+	int i;
+
+	if (e_shnum && e_shentsize != shdr_size) {
+		fprintf(stderr, "error: unexpected section header size %u\n", e_shentsize);
+		return -1;
 	}
-	rv = find_build_id(elf_fd, &info);
-	if (rv < 0)
-		goto out;
-	if (rv == 0) {
-		fprintf(stderr, "Sorry, couldn't find Build ID in that ELF file.\n");
-		goto out;
+	phdrs = fetch_data(elf, e_phoff, (uint64_t)e_phnum * e_phentsize);
+	shdrs = fetch_data(elf, e_shoff, (uint64_t)e_shnum * e_shentsize);
+	if (!phdrs || !shdrs)
+		return -1;
+
+	memcpy(&copy, ehdr, ehdr_size);
+	if (is64)
+		copy.e64.e_phoff = copy.e64.e_shoff = 0;
+	else
+		copy.e32.e_phoff = copy.e32.e_shoff = 0;
+	if (!EVP_DigestUpdate(ctx, &copy, ehdr_size) ||
+	    !EVP_DigestUpdate(ctx, phdrs, (size_t)e_phnum * e_phentsize))
+		return -1;
+
+	for (i = 0; i < e_shnum; i++) {
+		void *shdr = shdrs + i * e_shentsize;
+
+		if (getfield32(elf, shdr, Shdr, sh_type) == SHT_SYMTAB)
+			symstr = getfield32(elf, shdr, Shdr, sh_link);
 	}
-	rv = 0;
-	if (print) {
-		printf("%s\n", info.hex);
+	for (i = 0; i < e_shnum; i++) {
+		void *shdr = shdrs + i * e_shentsize;
+		uint32_t sh_type = getfield32(elf, shdr, Shdr, sh_type);
+		uint64_t sh_offset = getaddr(elf, shdr, Shdr, sh_offset);
+		uint64_t sh_size = getaddr(elf, shdr, Shdr, sh_size);
+
+		memcpy(&copy, shdr, shdr_size);
+		if (is64)
+			copy.s64.sh_offset = 0;
+		else
+			copy.s32.sh_offset = 0;
+		if (!EVP_DigestUpdate(ctx, &copy, shdr_size))
+			return -1;
+
+		if (i == 0 || i == e_shstrndx || i == symstr || sh_type == SHT_NOBITS ||
+		    sh_type == SHT_SYMTAB || sh_type == SHT_SYMTAB_SHNDX)
+			continue;
+		if (!fetch_data(elf, sh_offset, sh_size) ||
+		    digest_zeroed(ctx, elf->data, sh_offset, sh_size, zero) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Pick the hash style from the markers the linker left in the file */
+static enum hash_style detect_hash_style(struct elfinfo *elf)
+{
+	uint64_t offset, size;
+	void *comment;
+
+	if (find_named_shdr(elf, elf->data, ".note.gnu.gold-version", &offset, &size) > 0)
+		return HASH_FLAT;
+	if (find_named_shdr(elf, elf->data, ".comment", &offset, &size) > 0 &&
+	    (comment = fetch_data(elf, offset, size)) &&
+	    memmem(comment, size, "Linker: LLD", 11))
+		return HASH_TREE;
+	return HASH_GNU;
+}
+
+/*
+ * Compute the build ID of the file into "out", which has room for
+ * info->bytes_size bytes. With HASH_AUTO, the style is detected, and stored
+ * back into *style. Returns 0 on success, or -1 on error.
+ */
+static int compute_build_id(int fd, struct buildid_info *info, enum hash_style *style,
+			    int nthreads, uint8_t *out)
+{
+	uint8_t md[EVP_MAX_MD_SIZE];
+	struct hash_zero zero;
+	struct elfinfo elf;
+	EVP_MD_CTX *ctx;
+	const EVP_MD *evp;
+	struct stat st;
+	int rv = -1;
+
+	if (info->bytes_size == 20) {
+		evp = EVP_sha1();
+	} else if (info->bytes_size == 16) {
+		evp = EVP_md5();
+	} else {
+		fprintf(stderr, "error: don't know how to compute a %zu byte build ID\n",
+			info->bytes_size);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		return -1;
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "error: not an ELF file\n");
+		return -1;
+	}
+	elf.size = st.st_size;
+	elf.data = mmap(NULL, elf.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (elf.data == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	madvise(elf.data, elf.size, MADV_SEQUENTIAL);
+	if (parse_ehdr(&elf) < 0)
+		goto out;
+
+	if (*style == HASH_AUTO)
+		*style = detect_hash_style(&elf);
+	pr_info("Hashing with the %s style\n", HASH_STYLE_NAMES[*style]);
+
+	/* GNU ld zeroes the whole note, the other linkers only the ID */
+	zero.offset = info->data_offset;
+	zero.size = info->bytes_size;
+	if (*style == HASH_GNU) {
+		zero.offset -= NOTE_HEADER_SIZE;
+		zero.size += NOTE_HEADER_SIZE;
+	}
+
+	if (*style == HASH_TREE) {
+		rv = hash_tree(&elf, evp, &zero, nthreads, md);
+	} else {
+		ctx = EVP_MD_CTX_new();
+		if (ctx && EVP_DigestInit_ex(ctx, evp, NULL)) {
+			if (*style == HASH_GNU)
+				rv = hash_gnu(&elf, ctx, &zero);
+			else
+				rv = digest_zeroed(ctx, elf.data, 0, elf.size, &zero);
+			if (rv == 0 && !EVP_DigestFinal_ex(ctx, md, NULL))
+				rv = -1;
+		}
+		EVP_MD_CTX_free(ctx);
+	}
+	if (rv < 0)
+		fprintf(stderr, "error: failed to hash the file\n");
+	else
+		memcpy(out, md, info->bytes_size);
+out:
+	munmap(elf.data, elf.size);
+	return rv;
+}
+
+/*
+ * The .gnu_debuglink section names the separate debuginfo file, followed by the
+ * CRC-32 of that whole file: the same CRC as zlib and gzip use. Debuginfo files
+ * can be gigabytes, so this uses slicing-by-8, which handles 8 bytes per step
+ * with 8 lookup tables, and splits large files into one contiguous piece per
+ * thread. The pieces' CRCs are combined by multiplying modulo the polynomial,
+ * as zlib's crc32_combine() does.
+ */
+#define CRC32_POLY 0xedb88320
+#define CRC_MIN_PIECE (16 << 20)
+
+static uint32_t crc_table[8][256];
+static uint32_t crc_x2n[32];   /* x^(2^n) mod P */
+
+/* Multiply a and b modulo P, in reflected bit order */
+static uint32_t crc_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+	return p;
+}
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+				crc_table[0][crc_table[j - 1][i] & 0xff];
+	crc_x2n[0] = 1U << 30;  /* x^1 */
+	for (i = 1; i < 32; i++)
+		crc_x2n[i] = crc_multmodp(crc_x2n[i - 1], crc_x2n[i - 1]);
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+	while (len && ((uintptr_t)p & 7)) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+			crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+			crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+			crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+/* Return the CRC of A followed by B, given the CRCs of each and B's length */
+static uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b)
+{
+	uint32_t p = 1U << 31;  /* x^0 */
+	int k = 3;              /* len_b is in bytes: x^(8 * len_b) */
+
+	for (; len_b; len_b >>= 1, k++)
+		if (len_b & 1)
+			p = crc_multmodp(crc_x2n[k & 31], p);
+	return crc_multmodp(p, crc_a) ^ crc_b;
+}
+
+struct crc_job {
+	const uint8_t *data;
+	size_t size;
+	uint32_t crc;
+};
+
+static void *crc_piece(void *arg)
+{
+	struct crc_job *job = arg;
+
+	job->crc = crc32_update(0, job->data, job->size);
+	return NULL;
+}
+
+/*
+ * Compute the CRC-32 of the whole file into crc_out. Returns 0 on success, or
+ * -1 on error.
+ */
+static int compute_crc32(int fd, int nthreads, uint32_t *crc_out)
+{
+	struct crc_job *jobs;
+	pthread_t *threads;
+	struct stat st;
+	size_t piece;
+	void *data;
+	int i;
+
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		return -1;
+	}
+	if (st.st_size == 0) {
+		*crc_out = 0;
+		return 0;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	if (nthreads > st.st_size / CRC_MIN_PIECE)
+		nthreads = st.st_size / CRC_MIN_PIECE;
+	if (nthreads < 1)
+		nthreads = 1;
+	piece = (st.st_size / nthreads + 7) & ~(size_t)7;
+	jobs = calloc(nthreads, sizeof(*jobs));
+	threads = calloc(nthreads, sizeof(*threads));
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].data = data + i * piece;
+		jobs[i].size = i == nthreads - 1 ? st.st_size - i * piece : piece;
+		if (i && pthread_create(&threads[i], NULL, crc_piece, &jobs[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	crc_piece(&jobs[0]);
+	*crc_out = jobs[0].crc;
+	for (i = 1; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		*crc_out = crc32_combine(*crc_out, jobs[i].crc, jobs[i].size);
+	}
+	free(threads);
+	free(jobs);
+	munmap(data, st.st_size);
+	return 0;
+}
+
+/*
+ * Find the .gnu_debuglink section of the ELF file, returning the offset and
+ * value of its CRC, a copy of the file name it holds, and whether the file's
+ * byte order differs from ours. Returns 1 if found, 0 if not, and -1 on error.
+ */
+static int find_debuglink(int fd, uint64_t *crc_offset, char **name_out,
+			  uint32_t *crc_out, bool *swap_out)
+{
+	struct elfinfo info;
+	struct stat st;
+	uint64_t offset = 0, size = 0, name_len;
+	uint32_t *crc;
+	char *name;
+	int rv;
+
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		return -1;
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "error: not an ELF file\n");
+		return -1;
+	}
+	info.size = st.st_size;
+	info.data = mmap(NULL, info.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (info.data == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	rv = parse_ehdr(&info);
+	if (rv == 0)
+		rv = find_named_shdr(&info, info.data, ".gnu_debuglink", &offset, &size);
+	if (rv <= 0)
+		goto out;
+	name = fetch_data(&info, offset, size);
+	if (!name) {
+		rv = -1;
+		goto out;
+	}
+	name_len = strnlen(name, size);
+	if (name_len == size || pad4(name_len + 1) + 4 > size) {
+		fprintf(stderr, "error: truncated .gnu_debuglink section\n");
+		rv = -1;
+		goto out;
+	}
+	*crc_offset = offset + pad4(name_len + 1);
+	crc = (uint32_t *)(name + pad4(name_len + 1));
+	*swap_out = info.endian != platform_endian();
+	*crc_out = *swap_out ? bswap_32(*crc) : *crc;
+	*name_out = strdup(name);
+	rv = 1;
+out:
+	munmap(info.data, info.size);
+	return rv;
+}
+
+/*
+ * The build ID index maps build IDs to paths, for a tree such as
+ * /usr/lib/debug. It is a header, followed by an array of fixed size entries
+ * sorted by build ID, followed by the NUL-terminated paths, so that it can be
+ * mapped and binary searched in place. It is in native byte order, and only
+ * meant to be used on the machine which built it.
+ */
+#define INDEX_MAGIC "BUILDIDX"
+#define INDEX_VERSION 1
+#define INDEX_ID_MAX 32
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t nr_entries;
+	uint64_t strings_size;
+};
+
+/*
+ * The ID is zero padded. Files without a build ID (or which failed to parse)
+ * have an id_len of 0, so that refreshing the index doesn't parse them again.
+ */
+struct index_entry {
+	uint8_t id[INDEX_ID_MAX];
+	uint32_t id_len;
+	uint32_t reserved;
+	uint64_t path;   /* offset of the path, after the entries */
+	int64_t mtime;   /* nanoseconds */
+	uint64_t size;
+};
+
+struct pending_entry {
+	struct index_entry entry;
+	char *path;
+};
+
+struct index {
+	/* the existing index, mapped read-only */
+	void *map;
+	size_t map_size;
+	struct index_entry *entries;
+	uint64_t nr_entries;
+	const char *strings;
+	struct index_entry **by_path;  /* for refreshing */
+
+	/* the new index, built by the batch workers */
+	bool building;
+	pthread_mutex_t lock;
+	struct pending_entry *pending;
+	size_t nr_pending, alloc_pending;
+};
+
+static struct index idx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int cmp_index_id(const void *a, const void *b)
+{
+	const struct index_entry *x = a, *y = b;
+	int rv = memcmp(x->id, y->id, INDEX_ID_MAX);
+
+	if (rv)
+		return rv;
+	return (x->id_len > y->id_len) - (x->id_len < y->id_len);
+}
+
+static int cmp_index_path(const void *a, const void *b)
+{
+	const struct index_entry *x = *(struct index_entry **)a;
+	const struct index_entry *y = *(struct index_entry **)b;
+
+	return strcmp(idx.strings + x->path, idx.strings + y->path);
+}
+
+/*
+ * Map an existing index and validate it. Returns 0 if it was loaded, 1 if it
+ * doesn't exist, and -1 on error.
+ */
+static int index_load(const char *index_file)
+{
+	struct index_header *hdr;
+	struct stat st;
+	uint64_t i, entries_size;
+	int fd = open(index_file, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 && errno == ENOENT)
+		return 1;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(index_file);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	idx.map_size = st.st_size;
+	if (idx.map_size < sizeof(*hdr)) {
+		close(fd);
+		goto invalid;
+	}
+	idx.map = mmap(NULL, idx.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (idx.map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	hdr = idx.map;
+	if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != INDEX_VERSION ||
+	    hdr->entry_size != sizeof(struct index_entry))
+		goto invalid;
+	entries_size = hdr->nr_entries * sizeof(struct index_entry);
+	if (hdr->nr_entries > idx.map_size / sizeof(struct index_entry) ||
+	    sizeof(*hdr) + entries_size + hdr->strings_size != idx.map_size)
+		goto invalid;
+	idx.entries = idx.map + sizeof(*hdr);
+	idx.nr_entries = hdr->nr_entries;
+	idx.strings = (const char *)idx.entries + entries_size;
+	if (hdr->strings_size && idx.strings[hdr->strings_size - 1] != '\0')
+		goto invalid;
+	for (i = 0; i < idx.nr_entries; i++)
+		if (idx.entries[i].path >= hdr->strings_size ||
+		    idx.entries[i].id_len > INDEX_ID_MAX)
+			goto invalid;
+	return 0;
+
+invalid:
+	fprintf(stderr, "error: %s is not a valid build ID index\n", index_file);
+	return -1;
+}
+
+/* Sort the existing entries by path, to find unchanged files when refreshing */
+static void index_prepare_refresh(void)
+{
+	uint64_t i;
+
+	idx.by_path = calloc(idx.nr_entries, sizeof(*idx.by_path));
+	for (i = 0; i < idx.nr_entries; i++)
+		idx.by_path[i] = &idx.entries[i];
+	qsort(idx.by_path, idx.nr_entries, sizeof(*idx.by_path), cmp_index_path);
+}
+
+static struct index_entry *index_find_path(const char *path)
+{
+	size_t lo = 0, hi = idx.nr_entries;
+
+	if (!idx.by_path)
+		return NULL;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int rv = strcmp(path, idx.strings + idx.by_path[mid]->path);
+
+		if (rv == 0)
+			return idx.by_path[mid];
+		if (rv < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+static int64_t stat_mtime(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static void index_add(const char *path, const struct stat *st,
+		      const uint8_t *id, size_t id_len)
+{
+	struct pending_entry *p;
+
+	pthread_mutex_lock(&idx.lock);
+	if (idx.nr_pending == idx.alloc_pending) {
+		idx.alloc_pending = idx.alloc_pending ? idx.alloc_pending * 2 : 1024;
+		idx.pending = realloc(idx.pending, idx.alloc_pending * sizeof(*p));
+	}
+	p = &idx.pending[idx.nr_pending++];
+	memset(p, 0, sizeof(*p));
+	if (id_len <= INDEX_ID_MAX) {
+		memcpy(p->entry.id, id, id_len);
+		p->entry.id_len = id_len;
+	}
+	p->entry.mtime = stat_mtime(st);
+	p->entry.size = st->st_size;
+	p->path = strdup(path);
+	pthread_mutex_unlock(&idx.lock);
+}
+
+static int cmp_pending(const void *a, const void *b)
+{
+	return cmp_index_id(&((const struct pending_entry *)a)->entry,
+			    &((const struct pending_entry *)b)->entry);
+}
+
+/* Write the new index to a temporary file, and rename it over the old one */
+static int index_write(const char *index_file)
+{
+	struct index_header hdr = { .magic = INDEX_MAGIC };
+	char tmp[PATH_MAX];
+	uint64_t off = 0;
+	size_t i;
+	FILE *f;
+
+	qsort(idx.pending, idx.nr_pending, sizeof(*idx.pending), cmp_pending);
+	hdr.version = INDEX_VERSION;
+	hdr.entry_size = sizeof(struct index_entry);
+	hdr.nr_entries = idx.nr_pending;
+	for (i = 0; i < idx.nr_pending; i++) {
+		idx.pending[i].entry.path = off;
+		off += strlen(idx.pending[i].path) + 1;
+	}
+	hdr.strings_size = off;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", index_file);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return -1;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	for (i = 0; i < idx.nr_pending; i++)
+		fwrite(&idx.pending[i].entry, sizeof(struct index_entry), 1, f);
+	for (i = 0; i < idx.nr_pending; i++)
+		fwrite(idx.pending[i].path, strlen(idx.pending[i].path) + 1, 1, f);
+	if (fflush(f) || ferror(f) || fsync(fileno(f))) {
+		perror(tmp);
+		fclose(f);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(f);
+	if (rename(tmp, index_file) < 0) {
+		perror("rename");
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Print every path in the index with the given build ID */
+static int index_lookup(const char *hex)
+{
+	struct index_entry key = {0};
+	size_t lo = 0, hi = idx.nr_entries, len = strlen(hex);
+	uint8_t *bytes = NULL;
+	int found = 0;
+
+	if (len % 2 == 0 && len / 2 <= INDEX_ID_MAX)
+		bytes = from_hex((char *)hex, len);
+	if (!bytes || !len) {
+		fprintf(stderr, "error: invalid build ID \"%s\"\n", hex);
+		free(bytes);
+		return -1;
+	}
+	memcpy(key.id, bytes, len / 2);
+	key.id_len = len / 2;
+	free(bytes);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cmp_index_id(&idx.entries[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < idx.nr_entries && !cmp_index_id(&idx.entries[lo], &key); lo++) {
+		printf("%s\n", idx.strings + idx.entries[lo].path);
+		found++;
+	}
+	return found;
+}
+
+/*
+ * Batch mode: find (and optionally edit) the build ID of every ELF file in a
+ * list of files and directory trees. The main thread walks the trees, and
+ * queues the paths for a pool of worker threads.
+ */
+#define QUEUE_LEN 1024
+
+struct edit {
+	char *old_hex;
+	char *new_hex;
+	uint8_t *new_bytes;
+};
+
+struct batch {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	char *queue[QUEUE_LEN];
+	unsigned int head, count;
+	bool done;
+
+	struct edit *edits;  /* sorted by old_hex */
+	size_t nr_edits;
+	bool verify;
+	enum hash_style style;
+	unsigned int uring_depth;  /* 0 unless using io_uring */
+
+	unsigned long files, elves, found, edited, reused, mismatched, errors;
+};
+
+static struct batch batch = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
+#define batch_inc(field) __atomic_fetch_add(&batch.field, 1, __ATOMIC_RELAXED)
+
+static void batch_push(const char *path)
+{
+	char *copy = strdup(path);
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.count == QUEUE_LEN)
+		pthread_cond_wait(&batch.not_full, &batch.lock);
+	batch.queue[(batch.head + batch.count++) % QUEUE_LEN] = copy;
+	pthread_cond_signal(&batch.not_empty);
+	pthread_mutex_unlock(&batch.lock);
+}
+
+/*
+ * Returns NULL once the queue is empty and no more paths will be added, or if
+ * it is empty and wait is false.
+ */
+static char *batch_pop(bool wait)
+{
+	char *path = NULL;
+
+	pthread_mutex_lock(&batch.lock);
+	while (wait && !batch.count && !batch.done)
+		pthread_cond_wait(&batch.not_empty, &batch.lock);
+	if (batch.count) {
+		path = batch.queue[batch.head];
+		batch.head = (batch.head + 1) % QUEUE_LEN;
+		batch.count--;
+		pthread_cond_signal(&batch.not_full);
+	}
+	pthread_mutex_unlock(&batch.lock);
+	return path;
+}
+
+static int cmp_edit(const void *a, const void *b)
+{
+	return strcmp(((const struct edit *)a)->old_hex, ((const struct edit *)b)->old_hex);
+}
+
+/*
+ * Each line of the mapping file is "OLD-BUILD-ID NEW-BUILD-ID". Every file
+ * whose build ID is OLD-BUILD-ID gets NEW-BUILD-ID instead.
+ */
+static int load_edits(const char *map_file)
+{
+	FILE *f = fopen(map_file, "r");
+	char old_hex[2 * MAX_BUILDID_SIZE + 1], new_hex[2 * MAX_BUILDID_SIZE + 1];
+	size_t alloc = 0, i;
+	int line = 0;
+
+	if (!f) {
+		perror(map_file);
+		return -1;
+	}
+	while (fscanf(f, "%1024s %1024s", old_hex, new_hex) == 2) {
+		struct edit *e;
+
+		line++;
+		if (batch.nr_edits == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			batch.edits = realloc(batch.edits, alloc * sizeof(*e));
+		}
+		e = &batch.edits[batch.nr_edits];
+		for (i = 0; old_hex[i]; i++)
+			old_hex[i] = tolower(old_hex[i]);
+		if (strlen(old_hex) != strlen(new_hex) || strlen(new_hex) % 2 ||
+		    !(e->new_bytes = from_hex(new_hex, strlen(new_hex)))) {
+			fprintf(stderr, "error: %s line %d: expected two build IDs of "
+				"the same size\n", map_file, line);
+			fclose(f);
+			return -1;
+		}
+		e->old_hex = strdup(old_hex);
+		e->new_hex = strdup(new_hex);
+		batch.nr_edits++;
+	}
+	fclose(f);
+	qsort(batch.edits, batch.nr_edits, sizeof(*batch.edits), cmp_edit);
+	return 0;
+}
+
+/*
+ * When refreshing an index, files whose size and mtime haven't changed keep
+ * their entry.
+ */
+static bool batch_reuse(const char *path, const struct stat *st)
+{
+	struct index_entry *old = index_find_path(path);
+
+	if (old && old->mtime == stat_mtime(st) && old->size == st->st_size) {
+		index_add(path, st, old->id, old->id_len);
+		batch_inc(reused);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Print, edit, index or verify an ELF file, given the result of searching it
+ * for its build ID, as returned by find_build_id().
+ */
+static void batch_result(const char *path, const struct stat *st, int rv,
+			 struct buildid_info *info)
+{
+	struct edit key, *e;
+	uint8_t *id;
+	int fd;
+
+	if (rv < 0) {
+		fprintf(stderr, "error: %s: could not parse ELF file\n", path);
+		batch_inc(errors);
+	}
+	if (idx.building && rv <= 0)
+		index_add(path, st, NULL, 0);
+	if (rv <= 0)
+		return;
+	batch_inc(found);
+
+	if (batch.verify) {
+		uint8_t computed[MAX_BUILDID_SIZE];
+		enum hash_style style = batch.style;
+		char *hex;
+
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		rv = fd < 0 ? -1 : compute_build_id(fd, info, &style, 1, computed);
+		if (fd >= 0)
+			close(fd);
+		if (rv < 0) {
+			fprintf(stderr, "error: %s: could not compute build ID\n", path);
+			batch_inc(errors);
+			goto out;
+		}
+		hex = to_hex(computed, info->bytes_size);
+		if (strcmp(hex, info->hex) == 0) {
+			printf("%s OK\n", path);
+		} else {
+			printf("%s MISMATCH %s %s\n", path, info->hex, hex);
+			batch_inc(mismatched);
+		}
+		free(hex);
+		goto out;
+	}
+	if (idx.building) {
+		if (info->bytes_size > INDEX_ID_MAX)
+			fprintf(stderr, "warning: %s: build ID too large to index\n", path);
+		id = from_hex(info->hex, strlen(info->hex));
+		index_add(path, st, id, info->bytes_size);
+		free(id);
+		goto out;
+	}
+	if (!batch.edits) {
+		printf("%s %s\n", path, info->hex);
+		goto out;
+	}
+	key.old_hex = info->hex;
+	e = bsearch(&key, batch.edits, batch.nr_edits, sizeof(key), cmp_edit);
+	if (!e)
+		goto out;
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+		batch_inc(errors);
+		goto out;
+	}
+	if (write_new_buildid(fd, info->data_offset, e->new_bytes, info->bytes_size) < 0) {
+		fprintf(stderr, "error: %s: failed to write build ID\n", path);
+		batch_inc(errors);
+	} else {
+		printf("%s %s\n", path, e->new_hex);
+		batch_inc(edited);
+	}
+	close(fd);
+out:
+	free(info->hex);
+}
+
+static void batch_file(const char *path)
+{
+	struct buildid_info info = {0};
+	unsigned char ident[SELFMAG];
+	struct stat st;
+	int fd, rv;
+
+	batch_inc(files);
+	if (idx.building) {
+		if (stat(path, &st) < 0) {
+			fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+			batch_inc(errors);
+			return;
+		}
+		if (batch_reuse(path, &st))
+			return;
+	}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+		batch_inc(errors);
+		return;
+	}
+	/* Skip non-ELF files without mapping them */
+	if (pread(fd, ident, SELFMAG, 0) != SELFMAG || memcmp(ident, ELFMAG, SELFMAG)) {
+		close(fd);
+		return;
+	}
+	batch_inc(elves);
+	rv = find_build_id(fd, &info);
+	close(fd);
+	batch_result(path, &st, rv, &info);
+}
+
+static void *batch_worker(void *arg)
+{
+	char *path;
+
+	while ((path = batch_pop(true))) {
+		batch_file(path);
+		free(path);
+	}
+	return NULL;
+}
+
+/*
+ * The io_uring engine (-U): on cold disks or network filesystems, each read in
+ * find_build_id() waits a full round trip, so threads spend most of their time
+ * blocked. Instead, each worker keeps up to DEPTH files in flight on its own
+ * ring. Each file is a small state machine: statx (only when refreshing an
+ * index), open, read the first page (the ELF header and usually the program
+ * headers), read the header table if it wasn't in that page, then read each
+ * note segment or section until the build ID turns up. Each step is submitted
+ * when the previous one completes, and every file's steps overlap with the
+ * others. Editing and verifying still happen synchronously in the worker.
+ *
+ * This uses the raw system calls, rather than liburing.
+ */
+#define PROBE_HEAD_SIZE 4096
+#define PROBE_NOTES_MAX (16 << 20)
+
+struct uring {
+	int fd;
+	unsigned int entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned int pending;  /* SQEs not yet submitted */
+};
+
+static int uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p = {0};
+
+	memset(r, 0, sizeof(*r));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+	r->entries = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_ring_size = r->cq_ring_size = max(r->sq_ring_size, r->cq_ring_size);
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto out_close;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto out_sq;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto out_cq;
+
+	r->sq_head = r->sq_ring + p.sq_off.head;
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+	return 0;
+
+out_cq:
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+out_sq:
+	munmap(r->sq_ring, r->sq_ring_size);
+out_close:
+	close(r->fd);
+	return -1;
+}
+
+static void uring_exit(struct uring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+}
+
+/*
+ * Return the next SQE, zeroed. The caller never has more operations in flight
+ * than the ring has entries, so there is always room.
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *r, void *user_data)
+{
+	unsigned int tail = *r->sq_tail, i = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)user_data;
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+	return sqe;
+}
+
+/* Submit the pending SQEs, and wait for at least one completion */
+static int uring_wait(struct uring *r)
+{
+	int rv;
+
+	do {
+		rv = syscall(__NR_io_uring_enter, r->fd, r->pending, 1,
+			     IORING_ENTER_GETEVENTS, NULL, 0);
+		if (rv >= 0)
+			r->pending -= rv;
+	} while (rv < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+	if (rv < 0)
+		perror("io_uring_enter");
+	return rv;
+}
+
+enum probe_state {
+	PROBE_STATX,
+	PROBE_OPEN,
+	PROBE_HEAD,
+	PROBE_PHDRS,
+	PROBE_PHDR_NOTES,
+	PROBE_SHDRS,
+	PROBE_SHDR_NOTES,
+};
+
+/* Everything before "head" is reset for each file */
+struct probe {
+	char *path;
+	enum probe_state state;
+	int fd;
+	struct statx stx;
+	struct stat st;
+	struct elfinfo info;
+	uint8_t *table;      /* program or section headers */
+	uint8_t *table_buf;  /* allocated if the table isn't in head */
+	uint16_t num, entsize;
+	int next;            /* next table entry to search */
+	uint64_t buf_offset;
+	size_t buf_len;
+	struct buildid_info result;
+
+	uint8_t head[PROBE_HEAD_SIZE];
+	uint8_t *buf;        /* notes being read, kept for the next file */
+	size_t buf_alloc;
+};
+
+static void probe_read(struct uring *r, struct probe *p, void *buf, uint64_t offset,
+		       size_t len)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r, p);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = p->fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+}
+
+static void probe_open(struct uring *r, struct probe *p)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r, p);
+
+	p->state = PROBE_OPEN;
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)p->path;
+	sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+static void probe_start(struct uring *r, struct probe *p, char *path)
+{
+	struct io_uring_sqe *sqe;
+
+	memset(p, 0, offsetof(struct probe, head));
+	p->path = path;
+	p->fd = -1;
+	batch_inc(files);
+	if (!idx.building) {
+		probe_open(r, p);
+		return;
+	}
+	p->state = PROBE_STATX;
+	sqe = uring_sqe(r, p);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = STATX_SIZE | STATX_MTIME;
+	sqe->addr2 = (uintptr_t)&p->stx;
+}
+
+/*
+ * Read the program or section header table, starting the search of it. If
+ * it's already in the first page, go straight to the search. Returns as
+ * probe_next_notes() does.
+ */
+static int probe_table(struct uring *r, struct probe *p, enum probe_state state,
+			uint64_t offset, uint16_t num, uint16_t entsize);
+
+/*
+ * Read the next note segment or section from the table, or move on to the
+ * section headers once the program headers are exhausted. Returns 1 if a read
+ * was submitted, 0 once there is nothing left to read, and -1 on error.
+ */
+static int probe_next_notes(struct uring *r, struct probe *p)
+{
+	uint64_t offset, size;
+	void *ehdr = p->head;
+	int i;
+
+	if (p->state == PROBE_PHDRS || p->state == PROBE_PHDR_NOTES) {
+		i = find_notes_phdr(p->table, &p->info, p->next, p->num, p->entsize,
+				    &offset, &size);
+		if (i < 0)
+			return probe_table(r, p, PROBE_SHDRS,
+					   getaddr((&p->info), ehdr, Ehdr, e_shoff),
+					   getfield16((&p->info), ehdr, Ehdr, e_shnum),
+					   getfield16((&p->info), ehdr, Ehdr, e_shentsize));
+		p->state = PROBE_PHDR_NOTES;
+	} else {
+		i = find_notes_shdr(p->table, &p->info, p->next, p->num, p->entsize,
+				    &offset, &size);
+		if (i < 0)
+			return 0;
+		p->state = PROBE_SHDR_NOTES;
+	}
+	p->next = i + 1;
+	if (size > PROBE_NOTES_MAX) {
+		fprintf(stderr, "error: %s: note at offset %"PRIu64" is too large\n",
+			p->path, offset);
+		batch_inc(errors);
+		return probe_next_notes(r, p);
+	}
+	if (size > p->buf_alloc) {
+		free(p->buf);
+		p->buf_alloc = 0;
+		p->buf = malloc(size);
+		if (!p->buf) {
+			fprintf(stderr, "error: %s: out of memory\n", p->path);
+			return -1;
+		}
+		p->buf_alloc = size;
+	}
+	p->buf_offset = offset;
+	p->buf_len = size;
+	probe_read(r, p, p->buf, offset, size);
+	return 1;
+}
+
+static int probe_table(struct uring *r, struct probe *p, enum probe_state state,
+			uint64_t offset, uint16_t num, uint16_t entsize)
+{
+	size_t len = (size_t)num * entsize;
+
+	p->state = state;
+	p->num = num;
+	p->entsize = entsize;
+	p->next = 0;
+	if (!num) {
+		if (state == PROBE_PHDRS)
+			return probe_next_notes(r, p);
+		return 0;
+	}
+	if (offset <= p->info.size && len <= p->info.size - offset) {
+		p->table = p->head + offset;
+		return probe_next_notes(r, p);
+	}
+	free(p->table_buf);
+	p->table = p->table_buf = malloc(len);
+	if (!p->table_buf) {
+		fprintf(stderr, "error: %s: out of memory\n", p->path);
+		return -1;
+	}
+	probe_read(r, p, p->table, offset, len);
+	return 1;
+}
+
+/*
+ * Handle the completion of the probe's last operation, and submit the next
+ * one. Returns false once the probe is finished, and the slot can be reused.
+ */
+static bool probe_step(struct uring *r, struct probe *p, int res)
+{
+	void *ehdr = p->head;
+	int rv = 0;
+
+	if (res < 0) {
+		fprintf(stderr, "error: %s: %s\n", p->path, strerror(-res));
+		batch_inc(errors);
+		goto done;
+	}
+	switch (p->state) {
+	case PROBE_STATX:
+		p->st.st_size = p->stx.stx_size;
+		p->st.st_mtim.tv_sec = p->stx.stx_mtime.tv_sec;
+		p->st.st_mtim.tv_nsec = p->stx.stx_mtime.tv_nsec;
+		if (batch_reuse(p->path, &p->st))
+			goto done;
+		probe_open(r, p);
+		return true;
+	case PROBE_OPEN:
+		p->fd = res;
+		p->state = PROBE_HEAD;
+		probe_read(r, p, p->head, 0, PROBE_HEAD_SIZE);
+		return true;
+	case PROBE_HEAD:
+		/* Skip non-ELF files after one read */
+		if (res < SELFMAG || memcmp(p->head, ELFMAG, SELFMAG))
+			goto done;
+		batch_inc(elves);
+		p->info.data = p->head;
+		p->info.size = res;
+		if (parse_ehdr(&p->info) < 0) {
+			rv = -1;
+			goto result;
+		}
+		rv = probe_table(r, p, PROBE_PHDRS,
+				 getaddr((&p->info), ehdr, Ehdr, e_phoff),
+				 getfield16((&p->info), ehdr, Ehdr, e_phnum),
+				 getfield16((&p->info), ehdr, Ehdr, e_phentsize));
+		if (rv > 0)
+			return true;
+		goto result;
+	case PROBE_PHDRS:
+	case PROBE_SHDRS:
+		if (res != (size_t)p->num * p->entsize) {
+			fprintf(stderr, "error: %s: header table is beyond the end of the file\n",
+				p->path);
+			rv = -1;
+			goto result;
+		}
+		rv = probe_next_notes(r, p);
+		if (rv > 0)
+			return true;
+		goto result;
+	case PROBE_PHDR_NOTES:
+	case PROBE_SHDR_NOTES:
+		if (res != p->buf_len) {
+			fprintf(stderr, "error: %s: data at offset %"PRIu64" (size %zu) is "
+				"beyond the end of the file\n", p->path, p->buf_offset,
+				p->buf_len);
+			rv = -1;
+			goto result;
+		}
+		rv = find_buildid_in(&p->info, p->buf, p->buf_offset, p->buf_len,
+				     &p->result);
+		if (rv == 0 && (rv = probe_next_notes(r, p)) > 0)
+			return true;
+		goto result;
+	}
+result:
+	close(p->fd);
+	p->fd = -1;
+	batch_result(p->path, &p->st, rv, &p->result);
+done:
+	if (p->fd >= 0)
+		close(p->fd);
+	free(p->table_buf);
+	p->table_buf = NULL;
+	free(p->path);
+	return false;
+}
+
+static void *batch_uring_worker(void *arg)
+{
+	unsigned int depth = batch.uring_depth, inflight = 0, nfree, head, tail;
+	struct probe *probes, **free_probes;
+	struct uring r;
+	char *path;
+
+	if (uring_init(&r, depth) < 0) {
+		perror("io_uring_setup");
+		fprintf(stderr, "warning: falling back to synchronous reads\n");
+		return batch_worker(arg);
+	}
+	if (depth > r.entries)
+		depth = r.entries;
+	probes = calloc(depth, sizeof(*probes));
+	free_probes = calloc(depth, sizeof(*free_probes));
+	if (!probes || !free_probes) {
+		fprintf(stderr, "warning: out of memory, falling back to synchronous reads\n");
+		free(free_probes);
+		free(probes);
+		uring_exit(&r);
+		return batch_worker(arg);
+	}
+	for (nfree = 0; nfree < depth; nfree++)
+		free_probes[nfree] = &probes[nfree];
+
+	for (;;) {
+		/* Only block for new paths when nothing else is in flight */
+		while (nfree && (path = batch_pop(!inflight))) {
+			probe_start(&r, free_probes[--nfree], path);
+			inflight++;
+		}
+		if (!inflight)
+			break;
+		if (uring_wait(&r) < 0)
+			exit(EXIT_FAILURE);
+
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+			struct probe *p = (struct probe *)(uintptr_t)cqe->user_data;
+
+			if (!probe_step(&r, p, cqe->res)) {
+				free_probes[nfree++] = p;
+				inflight--;
+			}
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+	for (nfree = 0; nfree < depth; nfree++)
+		free(probes[nfree].buf);
+	free(free_probes);
+	free(probes);
+	uring_exit(&r);
+	return NULL;
+}
+
+static int batch_visit(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	if (type == FTW_F && S_ISREG(st->st_mode))
+		batch_push(path);
+	else if (type == FTW_DNR || type == FTW_NS)
+		fprintf(stderr, "error: cannot access %s\n", path);
+	return 0;
+}
+
+static void batch_add(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+		batch_inc(errors);
+	} else if (S_ISDIR(st.st_mode)) {
+		nftw(path, batch_visit, 64, FTW_PHYS);
+	} else {
+		batch_push(path);
+	}
+}
+
+static int run_batch(char **paths, int npaths, const char *list_file,
+		     const char *index_file, int nthreads)
+{
+	struct timespec start, end;
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+	void *(*worker)(void *) = batch.uring_depth ? batch_uring_worker : batch_worker;
+	double elapsed;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (index_file) {
+		if (index_load(index_file) < 0)
+			exit(EXIT_FAILURE);
+		index_prepare_refresh();
+		idx.building = true;
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < npaths; i++)
+		batch_add(paths[i]);
+	if (list_file) {
+		FILE *f = strcmp(list_file, "-") ? fopen(list_file, "r") : stdin;
+		char *line = NULL;
+		size_t len = 0;
+		ssize_t n;
+
+		if (!f) {
+			perror(list_file);
+			exit(EXIT_FAILURE);
+		}
+		while ((n = getline(&line, &len, f)) > 0) {
+			if (line[n - 1] == '\n')
+				line[--n] = '\0';
+			if (n)
+				batch_add(line);
+		}
+		free(line);
+		if (f != stdin)
+			fclose(f);
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	batch.done = true;
+	pthread_cond_broadcast(&batch.not_empty);
+	pthread_mutex_unlock(&batch.lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	if (index_file && index_write(index_file) < 0)
+		batch_inc(errors);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fflush(stdout);
+	fprintf(stderr, "%lu files, %lu ELF, %lu build IDs, %lu edited, %lu unchanged, "
+		"%lu mismatched, %lu errors in %.2fs (%.0f files/sec)\n", batch.files,
+		batch.elves, batch.found, batch.edited, batch.reused, batch.mismatched,
+		batch.errors, elapsed, batch.files / elapsed);
+	return batch.errors || batch.mismatched ? 1 : 0;
+}
+
+void help(void)
+{
+	puts(
+		"usage: editbuildid [-n BUILD-ID | -p | -R | -V] [-S STYLE] [-T] [-v] [-h] ELF-FILE\n"
+		"       editbuildid -L DEBUG-FILE [-j THREADS] [-T] [-v] ELF-FILE\n"
+		"       editbuildid -b [-j THREADS] [-U DEPTH] [-l LIST] [-m MAP | -I INDEX | -V]\n"
+		"                      [PATH...]\n"
+		"       editbuildid -I INDEX -f BUILD-ID\n"
+		"\n"
+		"Find the build ID of an ELF file and either print it (-p) and exit,\n"
+		"overwrite it with the given value (-n BUILD-ID), recompute it from the\n"
+		"file contents (-R), or check that it matches the file contents (-V).\n"
+		"Exactly one of these must be specified.\n"
+		"\n"
+		"With -L, instead set the CRC in the .gnu_debuglink section of ELF-FILE\n"
+		"to match DEBUG-FILE, for example after editing its build ID.\n"
+		"\n"
+		"In batch mode (-b), find the build ID of every ELF file in the given files\n"
+		"and directory trees, and print \"PATH BUILD-ID\" lines. With a mapping\n"
+		"file (-m), instead edit every file whose build ID is listed in it. With\n"
+		"an index (-I), instead build or refresh the index, which -f searches.\n"
+		"With -V, instead verify every file's build ID.\n"
+		"\n"
+		"Options:\n"
+		"  -n, --new BUILD-ID   specify the new BUILD-ID value\n"
+		"  -p, --print          print the current build ID value and exit\n"
+		"  -R, --recompute      recompute the build ID, by hashing the file with\n"
+		"                       the build ID zeroed, and write it\n"
+		"  -V, --verify         recompute the build ID, and report whether it\n"
+		"                       matches, exiting with status 1 if not\n"
+		"  -S, --style STYLE    how -R and -V hash the file, following the linker:\n"
+		"                       \"gnu\" (GNU ld), \"flat\" (gold), \"tree\" (lld),\n"
+		"                       or \"auto\" to detect the linker (the default)\n"
+		"  -L, --debuglink DEBUG-FILE\n"
+		"                       set the .gnu_debuglink CRC to that of DEBUG-FILE\n"
+		"  -T, --time           print the time taken to find (or hash) the build ID\n"
+		"                       to stderr\n"
+		"  -b, --batch          batch mode, see above\n"
+		"  -j, --jobs THREADS   number of threads for batch mode, hashing and CRCs\n"
+		"                       (default: CPUs)\n"
+		"  -U, --uring DEPTH    in batch mode, read files with io_uring, keeping up\n"
+		"                       to DEPTH files in flight per thread\n"
+		"  -l, --list LIST      also process the paths in LIST, one per line (or\n"
+		"                       \"-\" for stdin)\n"
+		"  -m, --map MAP        edit files using MAP, where each line is\n"
+		"                       \"OLD-BUILD-ID NEW-BUILD-ID\"\n"
+		"  -I, --index INDEX    build ID index file to refresh or search\n"
+		"  -f, --find BUILD-ID  print the paths in INDEX with the given build ID\n"
+		"  -v, --verbose        print informational messages\n"
+		"  -h, --help           print this message and exit\n"
+		"\n"
+		"Stephen Brennan <stephen.s.brennan@oracle.com>"
+	);
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Set the .gnu_debuglink CRC of elf_file to the CRC of debug_file. Returns the
+ * exit status.
+ */
+static int fix_debuglink(const char *elf_file, const char *debug_file, int nthreads,
+			 bool timing)
+{
+	struct timespec start, end;
+	uint64_t crc_offset;
+	uint32_t old_crc, new_crc, raw;
+	const char *base;
+	char *name = NULL;
+	int elf_fd, debug_fd, rv = 1;
+	bool swap;
+
+	elf_fd = open(elf_file, O_RDWR);
+	if (elf_fd < 0) {
+		fprintf(stderr, "failed to open %s to write\n", elf_file);
+		perror("open");
+		return 1;
+	}
+	debug_fd = open(debug_file, O_RDONLY);
+	if (debug_fd < 0) {
+		fprintf(stderr, "failed to open %s to read\n", debug_file);
+		perror("open");
+		goto out;
+	}
+	rv = find_debuglink(elf_fd, &crc_offset, &name, &old_crc, &swap);
+	if (rv == 0)
+		fprintf(stderr, "error: %s has no .gnu_debuglink section\n", elf_file);
+	if (rv <= 0) {
+		rv = 1;
+		goto out;
+	}
+	pr_info("Found debuglink to %s with CRC %08x\n", name, old_crc);
+	base = strrchr(debug_file, '/');
+	base = base ? base + 1 : debug_file;
+	if (strcmp(base, name) != 0)
+		fprintf(stderr, "warning: %s links to \"%s\", not \"%s\"\n",
+			elf_file, name, base);
+
+	crc_init();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rv = compute_crc32(debug_fd, nthreads, &new_crc);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (rv < 0) {
+		rv = 1;
+		goto out;
+	}
+	if (timing) {
+		double secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+		struct stat st;
+
+		fstat(debug_fd, &st);
+		fprintf(stderr, "%s: CRC in %.1f ms (%.1f MiB/s)\n", debug_file,
+			secs * 1e3, st.st_size / secs / (1 << 20));
+	}
+	if (new_crc == old_crc) {
+		pr_info("CRC is already up to date\n");
+	} else {
+		raw = swap ? bswap_32(new_crc) : new_crc;
+		if (write_new_buildid(elf_fd, crc_offset, (uint8_t *)&raw, sizeof(raw)) < 0) {
+			rv = 1;
+			goto out;
+		}
+		pr_info("Wrote new CRC: %08x\n", new_crc);
+	}
+	printf("%08x\n", new_crc);
+	rv = 0;
+out:
+	free(name);
+	if (debug_fd >= 0)
+		close(debug_fd);
+	close(elf_fd);
+	return rv;
+}
+
+int main(int argc, char **argv)
+{
+	struct buildid_info info;
+	char *newid_hex = NULL;
+	char *elf_file = NULL;
+	uint8_t *newid_bytes = NULL;
+	size_t newid_len = 0;
+	int elf_fd, opt, rv = 0;
+	bool print = false, timing = false, batch_mode = false;
+	bool recompute = false, verify = false;
+	enum hash_style style = HASH_AUTO;
+	uint8_t computed[MAX_BUILDID_SIZE];
+	struct timespec start, end;
+	const char *list_file = NULL, *map_file = NULL;
+	const char *index_file = NULL, *find_hex = NULL;
+	const char *debug_file = NULL;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	const char *shopt = "n:vhpRVS:L:Tbj:U:l:m:I:f:";
+	static struct option lopt[] = {
+		{"index",   required_argument, NULL, 'I'},
+		{"find",    required_argument, NULL, 'f'},
+		{"batch",   no_argument,       NULL, 'b'},
+		{"jobs",    required_argument, NULL, 'j'},
+		{"uring",   required_argument, NULL, 'U'},
+		{"list",    required_argument, NULL, 'l'},
+		{"map",     required_argument, NULL, 'm'},
+		{"new",     required_argument, NULL, 'n'},
+		{"verbose", no_argument,       NULL, 'v'},
+		{"help",    no_argument,       NULL, 'h'},
+		{"print",   no_argument,       NULL, 'p'},
+		{"recompute", no_argument,     NULL, 'R'},
+		{"verify",  no_argument,       NULL, 'V'},
+		{"style",   required_argument, NULL, 'S'},
+		{"debuglink", required_argument, NULL, 'L'},
+		{"time",    no_argument,       NULL, 'T'},
+		{0},
+	};
+	while ((opt = getopt_long(argc, argv, shopt, lopt, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+		case '?':
+			help();
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'p':
+			print = true;
+			break;
+		case 'n':
+			newid_hex = optarg;
+			break;
+		case 'R':
+			recompute = true;
+			break;
+		case 'V':
+			verify = true;
+			break;
+		case 'S':
+			for (style = HASH_AUTO; style <= HASH_TREE; style++)
+				if (strcmp(optarg, HASH_STYLE_NAMES[style]) == 0)
+					break;
+			if (style > HASH_TREE) {
+				fprintf(stderr, "error: unknown hash style \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+		case 'L':
+			debug_file = optarg;
+			break;
+		case 'T':
+			timing = true;
+			break;
+		case 'b':
+			batch_mode = true;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'U':
+			batch.uring_depth = atoi(optarg);
+			if (batch.uring_depth < 1) {
+				fprintf(stderr, "error: invalid io_uring depth \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			list_file = optarg;
+			break;
+		case 'm':
+			map_file = optarg;
+			break;
+		case 'I':
+			index_file = optarg;
+			break;
+		case 'f':
+			find_hex = optarg;
+			break;
+		}
+	}
+	argv += optind;
+	argc -= optind;
+
+	if (find_hex) {
+		if (!index_file || batch_mode || print || newid_hex || recompute ||
+		    verify || debug_file || argc) {
+			fprintf(stderr, "error: --find requires --index, and no other mode\n");
+			return 1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rv = index_load(index_file);
+		if (rv > 0)
+			fprintf(stderr, "error: %s does not exist\n", index_file);
+		if (rv == 0)
+			rv = index_lookup(find_hex) > 0 ? 0 : 1;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (timing)
+			fprintf(stderr, "lookup: %.1f us\n", (end.tv_sec - start.tv_sec) * 1e6 +
+				(end.tv_nsec - start.tv_nsec) / 1e3);
+		return rv ? 1 : 0;
+	}
+	if (batch_mode) {
+		if (print || newid_hex || recompute || debug_file || timing) {
+			fprintf(stderr, "error: --batch can't be used with --print, --new, "
+				"--recompute, --debuglink or --time\n");
+			return 1;
+		}
+		if (!argc && !list_file) {
+			fprintf(stderr, "error: --batch requires paths or --list\n");
+			return 1;
+		}
+		if (!!map_file + !!index_file + verify > 1) {
+			fprintf(stderr, "error: --map, --index and --verify are mutually exclusive\n");
+			return 1;
+		}
+		batch.verify = verify;
+		batch.style = style;
+		if (map_file && load_edits(map_file) < 0)
+			return 1;
+		return run_batch(argv, argc, list_file, index_file,
+				 nthreads > 0 ? nthreads : 1);
+	} else if (list_file || map_file || index_file || batch.uring_depth) {
+		fprintf(stderr, "error: --list, --map, --index and --uring require --batch\n");
+		return 1;
+	}
+
+	if (argc != 1) {
+		fprintf(stderr, "error: require exactly one argument (ELF-FILE)\n");
+		return 1;
+	}
+	if (print + !!newid_hex + recompute + verify + !!debug_file > 1) {
+		fprintf(stderr, "error: --print, --new, --recompute, --verify and "
+			"--debuglink are mutually exclusive\n");
+		return 1;
+	} else if (!(print || newid_hex || recompute || verify || debug_file)) {
+		fprintf(stderr, "error: one of --print, --new, --recompute, --verify or "
+			"--debuglink should be specified\n");
+		return 1;
+	}
+	elf_file = argv[0];
+	if (debug_file)
+		return fix_debuglink(elf_file, debug_file, nthreads > 0 ? nthreads : 1,
+				     timing);
+	memset(&info, 0, sizeof(info));
+
+	elf_fd = open(elf_file, newid_hex || recompute ? O_RDWR : O_RDONLY, 0);
+	if (elf_fd < 0) {
+		fprintf(stderr, "failed to open %s to read\n", elf_file);
+		perror("open");
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rv = find_build_id(elf_fd, &info);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (timing)
+		fprintf(stderr, "%s: %.1f us\n", elf_file,
+			(end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
+	if (rv < 0)
+		goto out;
+	if (rv == 0) {
+		fprintf(stderr, "Sorry, couldn't find Build ID in that ELF file.\n");
+		goto out;
+	}
+	rv = 0;
+	if (print) {
+		printf("%s\n", info.hex);
+		goto out;
+	}
+	pr_info("Found old build ID: %s\n", info.hex);
+	if (recompute || verify) {
+		char *hex;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rv = compute_build_id(elf_fd, &info, &style, nthreads > 0 ? nthreads : 1,
+				      computed);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (rv < 0) {
+			rv = 1;
+			goto out;
+		}
+		if (timing) {
+			double secs = (end.tv_sec - start.tv_sec) +
+				(end.tv_nsec - start.tv_nsec) / 1e9;
+			struct stat st;
+
+			fstat(elf_fd, &st);
+			fprintf(stderr, "%s: hashed in %.1f ms (%.1f MiB/s)\n", elf_file,
+				secs * 1e3, st.st_size / secs / (1 << 20));
+		}
+		hex = to_hex(computed, info.bytes_size);
+		if (verify) {
+			if (strcmp(hex, info.hex) == 0) {
+				printf("OK\n");
+			} else {
+				printf("MISMATCH %s %s\n", info.hex, hex);
+				rv = 1;
+			}
+		} else if (strcmp(hex, info.hex) == 0) {
+			pr_info("Build ID is already up to date\n");
+			printf("%s\n", hex);
+		} else {
+			rv = write_new_buildid(elf_fd, info.data_offset, computed,
+					       info.bytes_size);
+			if (rv == 0) {
+				pr_info("Wrote new build ID: %s\n", hex);
+				printf("%s\n", hex);
+			}
+		}
+		free(hex);
 		goto out;
 	}
-	pr_info("Found old build ID: %s\n", info.hex);
 	newid_len = strlen(newid_hex);
 	if (newid_len % 2 == 0)
 		newid_bytes = from_hex(newid_hex, newid_len);
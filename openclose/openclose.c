@@ -1,19 +1,978 @@
+/*
+ * openclose: open and close a file in a tight loop.
+ *
+ * With --matrix, instead build a fixture tree of directories, symlinks and bind
+ * mounts, and measure the cost of open()+close() as a function of the shape of
+ * the path being resolved.
+ *
+ * With --engine, run a timed benchmark of the open/close loop using plain
+ * syscalls, io_uring, or io_uring direct descriptors, and report throughput and
+ * CPU cost per operation.
+ *
+ * With --latency, time each iteration of the plain loop using the TSC, and on
+ * SIGINT write out a latency histogram and the slowest calls with timestamps.
+ */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
-int main(int argc, char **argv)
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define nelem(arr) (sizeof(arr) / sizeof(arr[0]))
+
+/* RESOLVE_CACHED is new in 5.12, older headers may not have it */
+#ifndef RESOLVE_CACHED
+#define RESOLVE_CACHED 0x20
+#endif
+
+/*
+ * Axes of the cost matrix. Symlinks and bind mounts replace ordinary directory
+ * components of the path, so a cell is only valid when symlinks + mounts is no
+ * more than the depth. Each ".." is spelled "u/..", adding two components.
+ */
+static const int DEPTHS[] = {1, 4, 16, 64};
+static const int SYMLINKS[] = {0, 1, 4};
+static const int MOUNTS[] = {0, 1, 4};
+static const int DOTDOTS[] = {0, 1, 4};
+
+#define MAX_DEPTH 64
+#define MAX_MOUNTS 4
+#define WARMUP 1000
+
+static void fail(const char *msg)
 {
-	if (argc != 2) {
-		printf("usage: openclose FILE\n");
-		return 1;
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The fixture is a chain of real directories d0/d1/.../d63. The fixture root
+ * and each of those directories contain (where i is the next level down):
+ *   d<i>  - the next real directory
+ *   s<i>  - a symlink to d<i>
+ *   m<i>  - (only for i < MAX_MOUNTS) a recursive bind mount of d<i>
+ *   u     - an empty directory, used for "u/.." components
+ *   f     - a regular file, which is what we actually open
+ */
+static void fixture_create(const char *root)
+{
+	char path[PATH_MAX];
+	char target[16];
+	int len, i, fd;
+
+	if (mkdir(root, 0755) < 0 && errno != EEXIST)
+		fail("mkdir fixture root");
+	len = snprintf(path, sizeof(path), "%s", root);
+	for (i = 0; i <= MAX_DEPTH; i++) {
+		snprintf(path + len, sizeof(path) - len, "/u");
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			fail("mkdir");
+		snprintf(path + len, sizeof(path) - len, "/f");
+		fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0)
+			fail("create fixture file");
+		close(fd);
+		if (i == MAX_DEPTH)
+			break;
+
+		snprintf(target, sizeof(target), "d%d", i);
+		snprintf(path + len, sizeof(path) - len, "/s%d", i);
+		if (symlink(target, path) < 0 && errno != EEXIST)
+			fail("symlink");
+		snprintf(path + len, sizeof(path) - len, "/m%d", i);
+		if (i < MAX_MOUNTS && mkdir(path, 0755) < 0 && errno != EEXIST)
+			fail("mkdir");
+		len += snprintf(path + len, sizeof(path) - len, "/d%d", i);
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			fail("mkdir");
+	}
+}
+
+/* Return the path of the parent directory of level i (i.e. d0/.../d<i-1>) */
+static int level_path(char *buf, size_t bufsz, const char *root, int level)
+{
+	int len, i;
+
+	len = snprintf(buf, bufsz, "%s", root);
+	for (i = 0; i < level; i++)
+		len += snprintf(buf + len, bufsz - len, "/d%d", i);
+	return len;
+}
+
+/*
+ * Bind mount d<i> onto m<i>, deepest level first. Using MS_REC means that each
+ * mount carries along copies of the deeper mounts, so a path m0/m1/m2 crosses
+ * three mounts. Returns the number of levels mounted, which is zero when we
+ * lack the privileges to make a private mount namespace.
+ */
+static int fixture_mount(const char *root)
+{
+	char src[PATH_MAX], dst[PATH_MAX];
+	int i, len;
+
+	if (unshare(CLONE_NEWNS) < 0) {
+		fprintf(stderr, "warning: unshare(CLONE_NEWNS): %s: skipping mount crossings\n",
+			strerror(errno));
+		return 0;
+	}
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0)
+		fail("make mounts private");
+
+	for (i = MAX_MOUNTS - 1; i >= 0; i--) {
+		len = level_path(src, sizeof(src), root, i);
+		memcpy(dst, src, len);
+		snprintf(src + len, sizeof(src) - len, "/d%d", i);
+		snprintf(dst + len, sizeof(dst) - len, "/m%d", i);
+		if (mount(src, dst, NULL, MS_BIND | MS_REC, NULL) < 0)
+			fail("bind mount");
+	}
+	return MAX_MOUNTS;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	if (remove(path) < 0)
+		perror(path);
+	return 0;
+}
+
+static void fixture_destroy(const char *root, int nmounts)
+{
+	char path[PATH_MAX];
+	int i, len;
+
+	for (i = 0; i < nmounts; i++) {
+		len = level_path(path, sizeof(path), root, i);
+		snprintf(path + len, sizeof(path) - len, "/m%d", i);
+		if (umount2(path, MNT_DETACH) < 0)
+			perror("umount");
+	}
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * Build the path (relative to the fixture root) for one cell: the first
+ * "mounts" levels go through bind mounts, the next "symlinks" levels go through
+ * symlinks, and the remainder are plain directories.
+ */
+static void cell_path(char *buf, size_t bufsz, int depth, int symlinks, int mounts, int dotdots)
+{
+	int len = 0, i;
+
+	for (i = 0; i < depth; i++) {
+		char kind = 'd';
+
+		if (i < mounts)
+			kind = 'm';
+		else if (i < mounts + symlinks)
+			kind = 's';
+		len += snprintf(buf + len, bufsz - len, "%c%d/", kind, i);
+	}
+	for (i = 0; i < dotdots; i++)
+		len += snprintf(buf + len, bufsz - len, "u/../");
+	snprintf(buf + len, bufsz - len, "f");
+}
+
+static int openat2_cached(int dirfd, const char *path)
+{
+	struct open_how how = {
+		.flags = O_RDONLY,
+		.resolve = RESOLVE_CACHED,
+	};
+
+	return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+struct cell_result {
+	double open_ns;
+	double cached_ns;
+	double cached_pct;
+	bool cached_supported;
+};
+
+static void measure_cell(int rootfd, const char *path, unsigned long iters,
+			 struct cell_result *res)
+{
+	unsigned long i, hits = 0;
+	uint64_t start;
+	int fd;
+
+	for (i = 0; i < WARMUP; i++) {
+		fd = openat(rootfd, path, O_RDONLY);
+		if (fd < 0)
+			fail(path);
+		close(fd);
 	}
+
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		fd = openat(rootfd, path, O_RDONLY);
+		close(fd);
+	}
+	res->open_ns = (double)(now_ns() - start) / iters;
+
+	/*
+	 * RESOLVE_CACHED fails with EAGAIN whenever the lookup can't complete
+	 * in RCU-walk mode using only the dcache, so the success rate tells us
+	 * how often the plain open() above had to fall back to ref-walk.
+	 */
+	res->cached_supported = true;
+	fd = openat2_cached(rootfd, path);
+	if (fd < 0 && (errno == ENOSYS || errno == EINVAL)) {
+		res->cached_supported = false;
+		return;
+	}
+	if (fd >= 0)
+		close(fd);
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		fd = openat2_cached(rootfd, path);
+		if (fd >= 0) {
+			hits++;
+			close(fd);
+		}
+	}
+	res->cached_ns = (double)(now_ns() - start) / iters;
+	res->cached_pct = 100.0 * hits / iters;
+}
+
+static int run_matrix(const char *dir, unsigned long iters)
+{
+	char root[PATH_MAX], path[PATH_MAX];
+	struct cell_result res;
+	int d, s, m, k, rootfd, nmounts;
+
+	snprintf(root, sizeof(root), "%s/openclose-fixture", dir);
+	fixture_create(root);
+	nmounts = fixture_mount(root);
+	rootfd = open(root, O_PATH | O_DIRECTORY);
+	if (rootfd < 0)
+		fail("open fixture root");
+
+	printf("%5s %8s %6s %6s %12s %12s %8s\n", "depth", "symlinks", "mounts",
+	       "dotdot", "open ns/op", "cached ns/op", "rcu-walk");
+	for (d = 0; d < nelem(DEPTHS); d++) {
+		for (s = 0; s < nelem(SYMLINKS); s++) {
+			for (m = 0; m < nelem(MOUNTS); m++) {
+				if (MOUNTS[m] > nmounts)
+					continue;
+				if (SYMLINKS[s] + MOUNTS[m] > DEPTHS[d])
+					continue;
+				for (k = 0; k < nelem(DOTDOTS); k++) {
+					cell_path(path, sizeof(path), DEPTHS[d], SYMLINKS[s],
+						  MOUNTS[m], DOTDOTS[k]);
+					measure_cell(rootfd, path, iters, &res);
+					printf("%5d %8d %6d %6d %12.1f ", DEPTHS[d], SYMLINKS[s],
+					       MOUNTS[m], DOTDOTS[k], res.open_ns);
+					if (res.cached_supported)
+						printf("%12.1f %7.1f%%\n", res.cached_ns, res.cached_pct);
+					else
+						printf("%12s %8s\n", "n/a", "n/a");
+					fflush(stdout);
+				}
+			}
+		}
+	}
+
+	close(rootfd);
+	fixture_destroy(root, nmounts);
+	return 0;
+}
+
+static int run_loop(const char *file)
+{
 	while (1) {
-		int fd = open(argv[1], O_RDONLY);
+		int fd = open(file, O_RDONLY);
 		if (fd < 0)
 			return 1;
 		close(fd);
 	}
 	return 0;
 }
+
+/*
+ * Per-call latency capture. We read the TSC directly, since clock_gettime()
+ * would be a noticeable fraction of a ~1us open+close. On other architectures
+ * we fall back to CLOCK_MONOTONIC, with a "TSC" frequency of 1GHz.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t read_tsc(void)
+{
+	return __rdtsc();
+}
+#else
+static inline uint64_t read_tsc(void)
+{
+	return now_ns();
+}
+#endif
+
+/* Histogram buckets: 4 linear sub-buckets for each power of two nanoseconds */
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct slow_call {
+	uint64_t cycles;
+	uint64_t tsc;
+	uint64_t iteration;
+};
+
+struct latency {
+	/* Calibration: a TSC reading at known times, and the TSC rate */
+	uint64_t base_tsc;
+	struct timespec base_mono;
+	struct timespec base_real;
+	double ns_per_cycle;
+
+	uint64_t hist[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t max_cycles;
+
+	/* Min-heap of the slowest calls, so the root is the one to evict */
+	struct slow_call *slowest;
+	unsigned int nslow;
+	unsigned int maxslow;
+};
+
+static volatile sig_atomic_t exiting;
+
+static void interrupt(int signal)
+{
+	exiting = 1;
+}
+
+static void latency_calibrate(struct latency *lat)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+	uint64_t tsc0, tsc1, ns0, ns1;
+
+	ns0 = now_ns();
+	tsc0 = read_tsc();
+	nanosleep(&ts, NULL);
+	ns1 = now_ns();
+	tsc1 = read_tsc();
+	lat->ns_per_cycle = (double)(ns1 - ns0) / (tsc1 - tsc0);
+
+	lat->base_tsc = read_tsc();
+	clock_gettime(CLOCK_MONOTONIC, &lat->base_mono);
+	clock_gettime(CLOCK_REALTIME, &lat->base_real);
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+	unsigned int msb, sub;
+
+	if (ns < HIST_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	sub = (ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+static uint64_t hist_bucket_floor(unsigned int bucket)
+{
+	unsigned int msb, sub;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+	msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	sub = bucket % HIST_SUB;
+	return ((uint64_t)1 << msb) | ((uint64_t)sub << (msb - HIST_SUB_BITS));
+}
+
+static void heap_sift_down(struct slow_call *heap, unsigned int n, unsigned int i)
+{
+	while (1) {
+		unsigned int l = 2 * i + 1, r = l + 1, min = i;
+		struct slow_call tmp;
+
+		if (l < n && heap[l].cycles < heap[min].cycles)
+			min = l;
+		if (r < n && heap[r].cycles < heap[min].cycles)
+			min = r;
+		if (min == i)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void heap_sift_up(struct slow_call *heap, unsigned int i)
+{
+	while (i) {
+		unsigned int parent = (i - 1) / 2;
+		struct slow_call tmp;
+
+		if (heap[parent].cycles <= heap[i].cycles)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+static inline void latency_record(struct latency *lat, uint64_t start, uint64_t end)
+{
+	uint64_t cycles = end - start;
+	struct slow_call call = { .cycles = cycles, .tsc = start, .iteration = lat->count };
+
+	lat->hist[hist_bucket(cycles * lat->ns_per_cycle)]++;
+	lat->count++;
+	if (cycles > lat->max_cycles)
+		lat->max_cycles = cycles;
+
+	if (lat->nslow < lat->maxslow) {
+		lat->slowest[lat->nslow] = call;
+		heap_sift_up(lat->slowest, lat->nslow++);
+	} else if (lat->maxslow && cycles > lat->slowest[0].cycles) {
+		lat->slowest[0] = call;
+		heap_sift_down(lat->slowest, lat->nslow, 0);
+	}
+}
+
+static struct timespec tsc_to_timespec(struct latency *lat, const struct timespec *base, uint64_t tsc)
+{
+	uint64_t ns = (uint64_t)base->tv_nsec + (uint64_t)((tsc - lat->base_tsc) * lat->ns_per_cycle);
+	struct timespec ts;
+
+	ts.tv_sec = base->tv_sec + ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	return ts;
+}
+
+static int cmp_slow_desc(const void *a, const void *b)
+{
+	const struct slow_call *x = a, *y = b;
+
+	if (x->cycles == y->cycles)
+		return 0;
+	return x->cycles < y->cycles ? 1 : -1;
+}
+
+static void latency_report(struct latency *lat, FILE *out)
+{
+	static const double PCTS[] = {50, 90, 99, 99.9, 99.99};
+	uint64_t cum = 0;
+	unsigned int i, p = 0;
+
+	fprintf(out, "calls: %lu  tsc: %.3f MHz  max: %.0f ns\n", lat->count,
+		1000.0 / lat->ns_per_cycle, lat->max_cycles * lat->ns_per_cycle);
+	if (!lat->count)
+		return;
+
+	fprintf(out, "\npercentiles (upper bound of bucket):\n");
+	for (i = 0; i < HIST_BUCKETS && p < nelem(PCTS); i++) {
+		cum += lat->hist[i];
+		while (p < nelem(PCTS) && cum * 100.0 >= PCTS[p] * lat->count)
+			fprintf(out, "  p%-6g < %lu ns\n", PCTS[p++], hist_bucket_floor(i + 1));
+	}
+
+	fprintf(out, "\nhistogram:\n%12s %12s %14s %8s\n", "from ns", "to ns", "count", "cum%");
+	cum = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!lat->hist[i])
+			continue;
+		cum += lat->hist[i];
+		fprintf(out, "%12lu %12lu %14lu %7.3f%%\n", hist_bucket_floor(i),
+			hist_bucket_floor(i + 1), lat->hist[i], 100.0 * cum / lat->count);
+	}
+
+	/*
+	 * Monotonic timestamps are comparable to kernel log timestamps (which
+	 * use local_clock), and wall clock times to anything else.
+	 */
+	qsort(lat->slowest, lat->nslow, sizeof(lat->slowest[0]), cmp_slow_desc);
+	fprintf(out, "\nslowest %u calls:\n%12s %18s %28s %12s\n", lat->nslow,
+		"ns", "monotonic", "realtime", "iteration");
+	for (i = 0; i < lat->nslow; i++) {
+		struct timespec mono = tsc_to_timespec(lat, &lat->base_mono, lat->slowest[i].tsc);
+		struct timespec real = tsc_to_timespec(lat, &lat->base_real, lat->slowest[i].tsc);
+		char timebuf[32];
+		struct tm tm;
+
+		localtime_r(&real.tv_sec, &tm);
+		strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &tm);
+		fprintf(out, "%12.0f %11ld.%06ld %19s.%06ld %12lu\n",
+			lat->slowest[i].cycles * lat->ns_per_cycle,
+			mono.tv_sec, mono.tv_nsec / 1000, timebuf, real.tv_nsec / 1000,
+			lat->slowest[i].iteration);
+	}
+}
+
+static int run_loop_latency(const char *file, unsigned int maxslow, const char *output)
+{
+	struct latency lat = { .maxslow = maxslow };
+	struct sigaction sa = { .sa_handler = interrupt };
+	FILE *out = stderr;
+	int rv = 0;
+
+	if (output) {
+		out = fopen(output, "w");
+		if (!out)
+			fail(output);
+	}
+	lat.slowest = calloc(maxslow ? maxslow : 1, sizeof(lat.slowest[0]));
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	latency_calibrate(&lat);
+
+	while (!exiting) {
+		uint64_t start = read_tsc();
+		int fd = open(file, O_RDONLY);
+
+		if (fd < 0) {
+			perror(file);
+			rv = 1;
+			break;
+		}
+		close(fd);
+		latency_record(&lat, start, read_tsc());
+	}
+
+	latency_report(&lat, out);
+	if (out != stderr)
+		fclose(out);
+	free(lat.slowest);
+	return rv;
+}
+
+/*
+ * Minimal io_uring setup using the raw syscalls, so we don't depend on
+ * liburing. We only ever submit a batch and then wait for all of it, so there's
+ * no need for anything more clever.
+ */
+struct uring {
+	int fd;
+	unsigned int entries;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+static void uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p = {0};
+	size_t sq_sz, cq_sz;
+	void *sq, *cq;
+
+	ring->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		fail("io_uring_setup");
+	ring->entries = p.sq_entries;
+
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_sz = cq_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		fail("mmap sq ring");
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			fail("mmap cq ring");
+	}
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		fail("mmap sqes");
+
+	ring->sq_tail = sq + p.sq_off.tail;
+	ring->sq_mask = sq + p.sq_off.ring_mask;
+	ring->sq_array = sq + p.sq_off.array;
+	ring->cq_head = cq + p.cq_off.head;
+	ring->cq_tail = cq + p.cq_off.tail;
+	ring->cq_mask = cq + p.cq_off.ring_mask;
+	ring->cqes = cq + p.cq_off.cqes;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/* Submit everything queued, wait for "count" completions and collect them */
+static void uring_submit_wait(struct uring *ring, unsigned int count, struct io_uring_cqe *out)
+{
+	unsigned int head, i;
+
+	if (syscall(SYS_io_uring_enter, ring->fd, count, count,
+		    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		fail("io_uring_enter");
+	head = *ring->cq_head;
+	for (i = 0; i < count; i++) {
+		/* GETEVENTS guarantees they're all here already */
+		out[i] = ring->cqes[(head + i) & *ring->cq_mask];
+	}
+	__atomic_store_n(ring->cq_head, head + count, __ATOMIC_RELEASE);
+}
+
+enum engine {
+	ENGINE_SYNC,
+	ENGINE_URING,
+	ENGINE_URING_DIRECT,
+	NR_ENGINES,
+};
+
+static const char *ENGINE_NAMES[] = {
+	[ENGINE_SYNC] = "sync",
+	[ENGINE_URING] = "uring",
+	[ENGINE_URING_DIRECT] = "uring-direct",
+};
+
+/* Each engine does one batch of open+close and returns how many it did */
+struct bench_ctx {
+	const char *file;
+	unsigned int batch;
+	struct uring ring;
+	struct io_uring_cqe *cqes;
+};
+
+static unsigned int batch_sync(struct bench_ctx *ctx)
+{
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < ctx->batch; i++) {
+		fd = open(ctx->file, O_RDONLY);
+		if (fd < 0)
+			fail(ctx->file);
+		close(fd);
+	}
+	return ctx->batch;
+}
+
+static unsigned int batch_uring(struct bench_ctx *ctx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+
+	for (i = 0; i < ctx->batch; i++) {
+		sqe = uring_get_sqe(&ctx->ring);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)ctx->file;
+		sqe->open_flags = O_RDONLY;
+	}
+	uring_submit_wait(&ctx->ring, ctx->batch, ctx->cqes);
+	for (i = 0; i < ctx->batch; i++) {
+		if (ctx->cqes[i].res < 0) {
+			errno = -ctx->cqes[i].res;
+			fail("IORING_OP_OPENAT");
+		}
+		sqe = uring_get_sqe(&ctx->ring);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = ctx->cqes[i].res;
+	}
+	uring_submit_wait(&ctx->ring, ctx->batch, ctx->cqes);
+	for (i = 0; i < ctx->batch; i++) {
+		if (ctx->cqes[i].res < 0) {
+			errno = -ctx->cqes[i].res;
+			fail("IORING_OP_CLOSE");
+		}
+	}
+	return ctx->batch;
+}
+
+/*
+ * Direct descriptors are opened into the ring's registered file table instead
+ * of the process fd table. The kernel picks the slot and returns it in the
+ * CQE, and we close it by slot (plus one, since zero means "not direct").
+ */
+static unsigned int batch_uring_direct(struct bench_ctx *ctx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+
+	for (i = 0; i < ctx->batch; i++) {
+		sqe = uring_get_sqe(&ctx->ring);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)ctx->file;
+		sqe->open_flags = O_RDONLY;
+		sqe->file_index = IORING_FILE_INDEX_ALLOC;
+	}
+	uring_submit_wait(&ctx->ring, ctx->batch, ctx->cqes);
+	for (i = 0; i < ctx->batch; i++) {
+		if (ctx->cqes[i].res < 0) {
+			errno = -ctx->cqes[i].res;
+			fail("IORING_OP_OPENAT (direct)");
+		}
+		sqe = uring_get_sqe(&ctx->ring);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = ctx->cqes[i].res + 1;
+	}
+	uring_submit_wait(&ctx->ring, ctx->batch, ctx->cqes);
+	for (i = 0; i < ctx->batch; i++) {
+		if (ctx->cqes[i].res < 0) {
+			errno = -ctx->cqes[i].res;
+			fail("IORING_OP_CLOSE (direct)");
+		}
+	}
+	return ctx->batch;
+}
+
+static unsigned int (*ENGINE_FNS[])(struct bench_ctx *) = {
+	[ENGINE_SYNC] = batch_sync,
+	[ENGINE_URING] = batch_uring,
+	[ENGINE_URING_DIRECT] = batch_uring_direct,
+};
+
+static void bench_setup(struct bench_ctx *ctx, enum engine engine)
+{
+	int *fds;
+	unsigned int i;
+
+	if (engine == ENGINE_SYNC)
+		return;
+	uring_init(&ctx->ring, ctx->batch);
+	if (ctx->ring.entries < ctx->batch) {
+		fprintf(stderr, "error: io_uring only gave us %u entries\n", ctx->ring.entries);
+		exit(EXIT_FAILURE);
+	}
+	ctx->cqes = calloc(ctx->batch, sizeof(*ctx->cqes));
+	if (engine != ENGINE_URING_DIRECT)
+		return;
+
+	/* A table of -1 entries registers an empty (sparse) file table */
+	fds = malloc(ctx->batch * sizeof(int));
+	for (i = 0; i < ctx->batch; i++)
+		fds[i] = -1;
+	if (syscall(SYS_io_uring_register, ctx->ring.fd, IORING_REGISTER_FILES,
+		    fds, ctx->batch) < 0)
+		fail("IORING_REGISTER_FILES");
+	free(fds);
+}
+
+static void bench_teardown(struct bench_ctx *ctx, enum engine engine)
+{
+	if (engine == ENGINE_SYNC)
+		return;
+	close(ctx->ring.fd);
+	free(ctx->cqes);
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct rusage ru;
+
+	/* io-wq workers are threads of this process, so they count too */
+	getrusage(RUSAGE_SELF, &ru);
+	return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000 +
+		((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+static void run_engine(const char *file, enum engine engine, unsigned int batch, double duration)
+{
+	struct bench_ctx ctx = { .file = file, .batch = batch };
+	uint64_t start, end, cpu_start, ops = 0;
+	double secs;
+
+	bench_setup(&ctx, engine);
+	start = now_ns();
+	end = start + (uint64_t)(duration * 1e9);
+	cpu_start = cpu_ns();
+	while (now_ns() < end)
+		ops += ENGINE_FNS[engine](&ctx);
+	secs = (now_ns() - start) / 1e9;
+	printf("%-14s %14.1f %12.1f\n", ENGINE_NAMES[engine], ops / secs,
+	       (double)(cpu_ns() - cpu_start) / ops);
+	fflush(stdout);
+	bench_teardown(&ctx, engine);
+}
+
+static int run_engines(const char *file, int engine, unsigned int batch, double duration)
+{
+	int i;
+
+	printf("%-14s %14s %12s\n", "engine", "ops/sec", "cpu ns/op");
+	for (i = 0; i < NR_ENGINES; i++)
+		if (engine < 0 || engine == i)
+			run_engine(file, i, batch, duration);
+	return 0;
+}
+
+void help(void)
+{
+	puts(
+		"usage: openclose [--latency [-s N] [-o OUTPUT]] FILE\n"
+		"       openclose --engine ENGINE [-b BATCH] [-d SECONDS] FILE\n"
+		"       openclose --matrix DIR [-n ITERATIONS]\n"
+		"\n"
+		"Open and close FILE as fast as possible, forever. Alternatively, with\n"
+		"--matrix, create a fixture tree in DIR and report the cost of open+close\n"
+		"for paths of varying depth, number of symlinks, number of bind mount\n"
+		"crossings and number of \"..\" components. Mount crossings require\n"
+		"CAP_SYS_ADMIN, and are skipped otherwise.\n"
+		"\n"
+		"For each cell, the \"cached\" columns repeat the measurement using\n"
+		"openat2(RESOLVE_CACHED), which only succeeds when the lookup can be\n"
+		"completed in RCU-walk mode. The rcu-walk column is the percentage of\n"
+		"those calls which succeeded; the rest required a ref-walk fallback.\n"
+		"\n"
+		"With --engine, run the loop for a fixed duration and report ops/sec and\n"
+		"CPU time per open+close. The engines are \"sync\" (open and close\n"
+		"syscalls), \"uring\" (batched IORING_OP_OPENAT and IORING_OP_CLOSE), and\n"
+		"\"uring-direct\" (the same, but into direct descriptors allocated with\n"
+		"IORING_FILE_INDEX_ALLOC, which never touch the fd table). Use \"all\" to\n"
+		"run each of them in turn.\n"
+		"\n"
+		"With --latency, the plain loop times every open+close with the TSC. On\n"
+		"SIGINT, it writes a latency histogram and the slowest N calls (with\n"
+		"monotonic timestamps comparable to the kernel log) and exits.\n"
+		"\n"
+		"Options:\n"
+		"  -e, --engine ENGINE   sync, uring, uring-direct, or all\n"
+		"  -b, --batch N         operations per io_uring submission (default 32)\n"
+		"  -d, --duration SECS   how long to run each engine (default 5)\n"
+		"  -l, --latency         record per-call latency, report on SIGINT\n"
+		"  -s, --slowest N       number of slowest calls to report (default 32)\n"
+		"  -o, --output FILE     write the latency report to FILE (default stderr)\n"
+		"  -m, --matrix DIR      build the fixture in DIR and print the cost matrix\n"
+		"  -n, --iterations N    iterations per matrix cell (default 100000)\n"
+		"  -h, --help            print this message and exit\n"
+	);
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+	char *matrix_dir = NULL;
+	unsigned long iters = 100000;
+	unsigned int batch = 32;
+	double duration = 5;
+	bool timed = false;
+	bool latency = false;
+	unsigned int slowest = 32;
+	char *output = NULL;
+	int engine = -1;
+	int opt, i;
+
+	const char *shopt = "e:b:d:ls:o:m:n:h";
+	static struct option lopt[] = {
+		{"engine",     required_argument, NULL, 'e'},
+		{"batch",      required_argument, NULL, 'b'},
+		{"duration",   required_argument, NULL, 'd'},
+		{"latency",    no_argument,       NULL, 'l'},
+		{"slowest",    required_argument, NULL, 's'},
+		{"output",     required_argument, NULL, 'o'},
+		{"matrix",     required_argument, NULL, 'm'},
+		{"iterations", required_argument, NULL, 'n'},
+		{"help",       no_argument,       NULL, 'h'},
+		{0},
+	};
+	while ((opt = getopt_long(argc, argv, shopt, lopt, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			help();
+			break;
+		case 'e':
+			timed = true;
+			if (strcmp(optarg, "all") == 0)
+				break;
+			for (i = 0; i < NR_ENGINES; i++)
+				if (strcmp(optarg, ENGINE_NAMES[i]) == 0)
+					engine = i;
+			if (engine < 0) {
+				fprintf(stderr, "--engine %s : unknown engine\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			timed = true;
+			duration = strtod(optarg, NULL);
+			break;
+		case 'l':
+			latency = true;
+			break;
+		case 's':
+			slowest = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'm':
+			matrix_dir = optarg;
+			break;
+		case 'n':
+			iters = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Invalid argument, try -h for help\n");
+			return 1;
+		}
+	}
+	argv += optind;
+	argc -= optind;
+
+	if (matrix_dir) {
+		if (argc != 0 || !iters) {
+			fprintf(stderr, "usage: openclose --matrix DIR [-n ITERATIONS]\n");
+			return 1;
+		}
+		return run_matrix(matrix_dir, iters);
+	}
+	if (argc != 1) {
+		printf("usage: openclose FILE\n");
+		return 1;
+	}
+	if (timed) {
+		if (!batch || duration <= 0) {
+			fprintf(stderr, "error: batch and duration must be positive\n");
+			return 1;
+		}
+		return run_engines(argv[0], engine, batch, duration);
+	}
+	if (latency)
+		return run_loop_latency(argv[0], slowest, output);
+	return run_loop(argv[0]);
+}
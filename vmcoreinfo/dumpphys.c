@@ -1,7 +1,7 @@
 /**
  * Dump the (uncompressed) physical memory from a core out to stdout.
  * Alternatively, search for a vmcoreinfo note inside that physical memory and
- * output it if we find it.
+ * output it if we find it, or search for build ID notes and list them.
  *
  * gcc -g -o dumphys{,.c} -lkdumpfile
  */
@@ -18,6 +18,9 @@
 
 #include <libkdumpfile/kdumpfile.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define GB (1UL << 30)
 #define MB (1UL << 20)
@@ -212,6 +215,145 @@ int check_vmcoreinfo(void *varg, uint64_t addr, uint64_t len, uint8_t *buf)
 	return 0;
 }
 
+/*
+ * Build ID notes are an Elf_Nhdr (namesz = 4, descsz, type = NT_GNU_BUILD_ID),
+ * then "GNU\0", then the ID. The kernel and each loaded module keep theirs in
+ * memory, so searching every page for the 4-byte aligned "GNU\0" name, and
+ * checking the header in front of it, finds the build IDs needed to fetch
+ * debuginfo. We assume the vmcore has the same byte order as we do.
+ */
+#define NT_GNU_BUILD_ID 3
+#define BUILDID_MIN 8
+#define BUILDID_MAX 64
+#define NHDR_SIZE 12
+
+struct buildid_arg {
+	int fd;
+	kdump_ctx_t *ctx;
+	char *vmlinux_id;  /* BUILD-ID from vmcoreinfo, if any */
+	int found_count;
+	int vmlinux_count;
+};
+
+/*
+ * Return the offset of the first 4-byte aligned "GNU\0" at or after off, or
+ * len if there is none. With SSE2, 64 bytes are screened per iteration.
+ */
+uint64_t find_gnu(const uint8_t *buf, uint64_t off, uint64_t len)
+{
+	uint32_t sig;
+
+	memcpy(&sig, "GNU", 4);
+#ifdef __SSE2__
+	const __m128i vsig = _mm_set1_epi32(sig);
+
+	while (off + 64 <= len) {
+		__m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(buf + off)), vsig);
+		__m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(buf + off + 16)), vsig);
+		__m128i c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(buf + off + 32)), vsig);
+		__m128i d = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(buf + off + 48)), vsig);
+
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))))
+			break;
+		off += 64;
+	}
+	while (off + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + off));
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, vsig)));
+
+		if (mask)
+			return off + 4 * __builtin_ctz(mask);
+		off += 16;
+	}
+#endif
+	for (; off + 4 <= len; off += 4)
+		if (memcmp(buf + off, &sig, 4) == 0)
+			return off;
+	return len;
+}
+
+/*
+ * Copy n bytes at pos (which may be negative, or run past the end) relative to
+ * the page at addr, reading from the vmcore for anything outside the page.
+ */
+int read_near(struct buildid_arg *arg, uint64_t addr, uint64_t len,
+	      const uint8_t *buf, int64_t pos, void *dst, size_t n)
+{
+	size_t got = n;
+	kdump_status ks;
+
+	if (pos >= 0 && pos + n <= len) {
+		memcpy(dst, buf + pos, n);
+		return 0;
+	}
+	if (pos < 0 && addr < (uint64_t)-pos)
+		return -1;
+	ks = kdump_read(arg->ctx, KDUMP_MACHPHYSADDR, addr + pos, dst, &got);
+	return (ks == KDUMP_OK && got == n) ? 0 : -1;
+}
+
+void check_note(struct buildid_arg *arg, uint64_t addr, uint64_t len,
+		const uint8_t *buf, uint64_t off)
+{
+	uint32_t nhdr[3];  /* namesz, descsz, type */
+	uint8_t desc[BUILDID_MAX];
+	char hex[2 * BUILDID_MAX + 1];
+	bool vmlinux, zero = true;
+	uint32_t i;
+
+	if (read_near(arg, addr, len, buf, (int64_t)off - NHDR_SIZE, nhdr, sizeof(nhdr)))
+		return;
+	if (nhdr[0] != 4 || nhdr[2] != NT_GNU_BUILD_ID ||
+	    nhdr[1] < BUILDID_MIN || nhdr[1] > BUILDID_MAX)
+		return;
+	if (read_near(arg, addr, len, buf, off + 4, desc, nhdr[1]))
+		return;
+	for (i = 0; i < nhdr[1]; i++) {
+		sprintf(hex + 2 * i, "%02x", desc[i]);
+		zero = zero && !desc[i];
+	}
+	if (zero)
+		return;
+	vmlinux = arg->vmlinux_id && strcmp(hex, arg->vmlinux_id) == 0;
+	dprintf(arg->fd, "0x%lx %s%s\n", addr + off - NHDR_SIZE, hex,
+		vmlinux ? " vmlinux" : "");
+	arg->found_count++;
+	arg->vmlinux_count += vmlinux;
+}
+
+int check_build_ids(void *varg, uint64_t addr, uint64_t len, uint8_t *buf)
+{
+	struct buildid_arg *arg = varg;
+	uint64_t off;
+
+	for (off = find_gnu(buf, 0, len); off < len; off = find_gnu(buf, off + 4, len))
+		check_note(arg, addr, len, buf, off);
+	return 0;
+}
+
+/* Return a copy of the vmcoreinfo BUILD-ID value, or NULL */
+char *vmcoreinfo_build_id(kdump_ctx_t *ctx)
+{
+	char *raw, *line, *id = NULL;
+	kdump_status ks;
+
+	ks = kdump_vmcoreinfo_raw(ctx, &raw);
+	if (ks != KDUMP_OK) {
+		fprintf(stderr, "warning: no vmcoreinfo: %s\n", kdump_get_err(ctx));
+		return NULL;
+	}
+	for (line = raw; line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+		if (strncmp(line, "BUILD-ID=", 9) == 0) {
+			id = strndup(line + 9, strcspn(line + 9, "\n"));
+			break;
+		}
+	}
+	free(raw);
+	if (!id)
+		fprintf(stderr, "warning: vmcoreinfo has no BUILD-ID (it was added in Linux 5.9)\n");
+	return id;
+}
+
 int count_pages(kdump_ctx_t *ctx, struct memory_info *mi, page_fn fn, void *arg, bool verbose, bool persist)
 {
 	kdump_status ks;
@@ -277,7 +419,9 @@ void help(void)
 		"Dumps raw memory contents from a vmcore (ELF or kdump) to stdout, or to the\n"
 		"file indicated by OUTPUT. Alternatively, if --vmcoreinfo is provided, searches\n"
 		"for any page that looks like a vmcoreinfo page and outputs the first one to\n"
-		"stdout or the file indicated by OUTPUT.\n"
+		"stdout or the file indicated by OUTPUT. Or, if --build-ids is provided,\n"
+		"searches for build ID notes, and outputs the physical address and build ID\n"
+		"of each one, marking those matching the vmcoreinfo BUILD-ID as \"vmlinux\".\n"
 		"\n"
 		"  -c, --core VMCORE    specifies the vmcore to read (required)\n"
 		"  -o, --output OUTPUT  specifies where to write output (default: stdout)\n"
@@ -286,6 +430,8 @@ void help(void)
 		"  -I                   same as -i, but keeps searching after finding one\n"
 		"  --flexible, -f       when searching for vmcoreinfo, also search outside of\n"
 		"                       page boundaries. Useful for older kernels\n"
+		"  --build-ids, -b      search for build ID notes (of the kernel and loaded\n"
+		"                       modules) rather than dumping all memory contents\n"
 		"  --verbose, -v        prints information about progress to stderr\n"
 		"  --persist, -p        continue trying to read pages of data even after we\n"
 		"                       encounter a read error\n"
@@ -311,9 +457,11 @@ int main(int argc, char **argv)
 		.should_continue = false,
 		.search_within_page = false,
 	};
+	struct buildid_arg bia = {0};
+	void *arg = &via;
 
 	int opt;
-	const char *shopt = "c:o:iIvhpf";
+	const char *shopt = "c:o:iIvhpfb";
 	static struct option lopt[] = {
 		{"core",       required_argument, NULL, 'c'},
 		{"output",     required_argument, NULL, 'o'},
@@ -322,6 +470,7 @@ int main(int argc, char **argv)
 		{"help",       no_argument,       NULL, 'h'},
 		{"persist",    no_argument,       NULL, 'p'},
 		{"flexible",   no_argument,       NULL, 'f'},
+		{"build-ids",  no_argument,       NULL, 'b'},
 		{0},
 	};
 	while ((opt = getopt_long(argc, argv, shopt, lopt, NULL)) != -1) {
@@ -353,6 +502,9 @@ int main(int argc, char **argv)
 			case 'f':
 				via.search_within_page = true;
 				break;
+			case 'b':
+				op = check_build_ids;
+				break;
 			default:
 				fprintf(stderr, "Invalid argument\n");
 				exit(EXIT_FAILURE);
@@ -378,8 +530,21 @@ int main(int argc, char **argv)
 		     kdump_get_err(ctx));
 
 	get_memory_info(ctx, &mi);
-	rv = count_pages(ctx, &mi, op, &via, verbose, persist);
-	if (op == check_vmcoreinfo && via.found_count > 1)
+	if (op == check_build_ids) {
+		bia.fd = via.fd;
+		bia.ctx = ctx;
+		bia.vmlinux_id = vmcoreinfo_build_id(ctx);
+		arg = &bia;
+	}
+	rv = count_pages(ctx, &mi, op, arg, verbose, persist);
+	if (op == check_build_ids) {
+		if (verbose)
+			fprintf(stderr, "found %d build ID notes\n", bia.found_count);
+		if (bia.vmlinux_id && !bia.vmlinux_count)
+			fprintf(stderr, "warning: the vmcoreinfo BUILD-ID %s was not found in memory\n",
+				bia.vmlinux_id);
+		free(bia.vmlinux_id);
+	} else if (op == check_vmcoreinfo && via.found_count > 1)
 		fprintf(stderr, "found %d vmcoreinfo-like notes\n", via.found_count);
 	else if (rv == 0 && via.found_count == 0 && op == check_vmcoreinfo)
 		fprintf(stderr, "error: could not find anything that looks like vmcoreinfo\n");